@@ -1,144 +1,195 @@
 #include "bleeding.h"
-#include <cstring>
+#include "threadpool.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <vector>
 
-void bleed_apply(uint8_t *image, int width, int height)
+// Transparent pixels are filled in layers: each layer gets the average color of its neighbors
+// from earlier layers, with the visible pixels as layer 0. Since a layer only reads pixels of
+// earlier layers, the pixels of a layer can be filled in any order and in parallel.
+
+enum State
+{
+	Unvisited, // transparent, not reached yet
+	Current,   // in the layer being filled
+	Done,      // visible or filled by an earlier layer
+	Border     // padding around the image
+};
+
+struct Pending
+{
+	size_t pixel; // byte offset in the image
+	size_t flag;  // index in the padded state grid
+};
+
+static const size_t chunk_size = 4096;
+
+static void run_tasks(ThreadPool *pool, size_t count, const std::function<void(size_t)> &task)
+{
+	if (pool != 0)
+	{
+		pool->run(count, task);
+	}
+	else
+	{
+		for (size_t i = 0; i < count; i++)
+			task(i);
+	}
+}
+
+static void append_chunks(std::vector<Pending> &out, const std::vector<std::vector<Pending> > &chunks)
+{
+	out.clear();
+
+	for (size_t i = 0; i < chunks.size(); i++)
+		out.insert(out.end(), chunks[i].begin(), chunks[i].end());
+}
+
+void bleed_apply(uint8_t *image, int width, int height, int pitch, ThreadPool *pool)
 {
-	const size_t N = width * height;
-
-	std::vector<int8_t> opaque(N);
-	std::vector<bool>   loose(N);
-	std::vector<size_t> pending;
-	std::vector<size_t> pendingNext;
-
-	pending.reserve(N);
-	pendingNext.reserve(N);
-
-	int offsets[][2] = {
-		{-1, -1},
-		{ 0, -1},
-		{ 1, -1},
-		{-1,  0},
-		{ 1,  0},
-		{-1,  1},
-		{ 0,  1},
-		{ 1,  1}
+	if (width <= 0 || height <= 0)
+		return;
+
+	const size_t flag_pitch = width + 2;
+	const size_t rows = height;
+
+	std::vector<std::atomic<uint8_t> > state(flag_pitch * (height + 2));
+
+	// neighbor offsets in the state grid and in the image
+	const ptrdiff_t flag_offsets[8] = {
+		-(ptrdiff_t)flag_pitch - 1, -(ptrdiff_t)flag_pitch, -(ptrdiff_t)flag_pitch + 1,
+		-1, 1,
+		(ptrdiff_t)flag_pitch - 1, (ptrdiff_t)flag_pitch, (ptrdiff_t)flag_pitch + 1
+	};
+
+	const ptrdiff_t pixel_offsets[8] = {
+		-(ptrdiff_t)pitch - 4, -(ptrdiff_t)pitch, -(ptrdiff_t)pitch + 4,
+		-4, 4,
+		(ptrdiff_t)pitch - 4, (ptrdiff_t)pitch, (ptrdiff_t)pitch + 4
+	};
+
+	// exact division by the neighbor count for sums up to 8 * 255
+	static const unsigned reciprocal[9] = {
+		0, 65536, 32768, 21846, 16384, 13108, 10923, 9363, 8192
 	};
 
-	for (size_t i = 0, j = 3; i < N; i++, j += 4)
+	for (size_t x = 0; x < flag_pitch; x++)
 	{
-		if (image[j] == 0)
-		{
-			bool isLoose = true;
+		state[x].store(Border, std::memory_order_relaxed);
+		state[(rows + 1) * flag_pitch + x].store(Border, std::memory_order_relaxed);
+	}
+
+	run_tasks(pool, rows, [&](size_t y)
+	{
+		const uint8_t *alpha = image + y * pitch + 3;
+		std::atomic<uint8_t> *flags = &state[(y + 1) * flag_pitch];
+
+		flags[0].store(Border, std::memory_order_relaxed);
+		flags[width + 1].store(Border, std::memory_order_relaxed);
+
+		for (int x = 0; x < width; x++)
+			flags[x + 1].store(alpha[x * 4] != 0 ? Done : Unvisited, std::memory_order_relaxed);
+	});
+
+	// the first layer is every transparent pixel next to a visible one
+	std::vector<std::vector<Pending> > chunks(rows);
+	std::vector<Pending> pending;
+
+	run_tasks(pool, rows, [&](size_t y)
+	{
+		std::vector<Pending> &out = chunks[y];
+
+		size_t pixel = y * pitch;
+		size_t flag = (y + 1) * flag_pitch + 1;
 
-			int x = i % width;
-			int y = i / width;
+		for (int x = 0; x < width; x++, pixel += 4, flag++)
+		{
+			if (state[flag].load(std::memory_order_relaxed) != Unvisited)
+				continue;
 
 			for (int k = 0; k < 8; k++)
 			{
-				int s = offsets[k][0];
-				int t = offsets[k][1];
-
-				if (x + s >= 0 && x + s < width && y + t >= 0 && y + t < height)
+				if (state[flag + flag_offsets[k]].load(std::memory_order_relaxed) == Done)
 				{
-					size_t index = j + 4 * (s + t * width);
-
-					if (image[index] != 0)
-					{
-						isLoose = false;
-						break;
-					}
+					Pending p = { pixel, flag };
+					out.push_back(p);
+					state[flag].store(Current, std::memory_order_relaxed);
+					break;
 				}
 			}
-
-			if (!isLoose)
-				pending.push_back(i);
-			else
-				loose[i] = true;
 		}
-		else
-		{
-			opaque[i] = -1;
-		}
-	}
+	});
+
+	append_chunks(pending, chunks);
 
 	while (pending.size() > 0)
 	{
-		pendingNext.clear();
+		const size_t count = (pending.size() + chunk_size - 1) / chunk_size;
 
-		for (size_t p = 0; p < pending.size(); p++)
+		run_tasks(pool, count, [&](size_t c)
 		{
-			size_t i = pending[p] * 4;
-			size_t j = pending[p];
+			const size_t end = std::min(pending.size(), (c + 1) * chunk_size);
 
-			int x = j % width;
-			int y = j / width;
-
-			int r = 0;
-			int g = 0;
-			int b = 0;
-
-			int count = 0;
-
-			for (size_t k = 0; k < 8; k++)
+			for (size_t i = c * chunk_size; i < end; i++)
 			{
-				int s = offsets[k][0];
-				int t = offsets[k][1];
+				uint8_t *p = image + pending[i].pixel;
+				const size_t flag = pending[i].flag;
 
-				if (x + s >= 0 && x + s < width && y + t >= 0 && y + t < height)
-				{
-					t *= width;
+				unsigned r = 0;
+				unsigned g = 0;
+				unsigned b = 0;
+				unsigned n = 0;
 
-					if (opaque[j + s + t] & 1)
+				for (int k = 0; k < 8; k++)
+				{
+					if (state[flag + flag_offsets[k]].load(std::memory_order_relaxed) == Done)
 					{
-						size_t index = i + 4 * (s + t);
-
-						r += image[index + 0];
-						g += image[index + 1];
-						b += image[index + 2];
+						const uint8_t *q = p + pixel_offsets[k];
 
-						count++;
+						r += q[0];
+						g += q[1];
+						b += q[2];
+						n++;
 					}
 				}
+
+				p[0] = (r * reciprocal[n]) >> 16;
+				p[1] = (g * reciprocal[n]) >> 16;
+				p[2] = (b * reciprocal[n]) >> 16;
 			}
+		});
 
-			if (count > 0)
-			{
-				image[i + 0] = r / count;
-				image[i + 1] = g / count;
-				image[i + 2] = b / count;
+		// the next layer is every unvisited neighbor, claimed by whichever chunk gets there first
+		chunks.assign(count, std::vector<Pending>());
 
-				opaque[j] = 0xFE;
+		run_tasks(pool, count, [&](size_t c)
+		{
+			const size_t end = std::min(pending.size(), (c + 1) * chunk_size);
+			std::vector<Pending> &out = chunks[c];
+
+			for (size_t i = c * chunk_size; i < end; i++)
+			{
+				state[pending[i].flag].store(Done, std::memory_order_relaxed);
 
-				for (size_t k = 0; k < 8; k++)
+				for (int k = 0; k < 8; k++)
 				{
-					int s = offsets[k][0];
-					int t = offsets[k][1];
+					const size_t flag = pending[i].flag + flag_offsets[k];
 
-					if (x + s >= 0 && x + s < width && y + t >= 0 && y + t < height)
-					{
-						size_t index = j + s + t * width;
+					if (state[flag].load(std::memory_order_relaxed) != Unvisited)
+						continue;
 
-						if (loose[index])
-						{
-							pendingNext.push_back(index);
-							loose[index] = false;
-						}
+					uint8_t expected = Unvisited;
+
+					if (state[flag].compare_exchange_strong(expected, Current, std::memory_order_relaxed))
+					{
+						Pending p = { pending[i].pixel + pixel_offsets[k], flag };
+						out.push_back(p);
 					}
 				}
 			}
-			else
-			{
-				pendingNext.push_back(j);
-			}
-		}
-
-		if (pendingNext.size() > 0)
-		{
-			for (size_t p = 0; p < pending.size(); p++)
-				opaque[pending[p]] >>= 1;
-		}
+		});
 
-		pending.swap(pendingNext);
+		append_chunks(pending, chunks);
 	}
 }
@@ -2,4 +2,9 @@
 
 #include <stdint.h>
 
-void bleed_apply(uint8_t *image, int width, int height);
+class ThreadPool;
+
+// Fills the color of transparent pixels from their visible neighbors. Rows of the image are
+// pitch bytes apart. The work is split between the threads of pool when one is given, the
+// result is the same either way.
+void bleed_apply(uint8_t *image, int width, int height, int pitch, ThreadPool *pool = 0);
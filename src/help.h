@@ -17,9 +17,17 @@ const char *help_text =
 	"-m, --metadata        Input metadata file in json format. (*)\n"
 	"-e, --pretty          Generated json file will be human readable.\n"
 	"-t, --trim            Trim input images.\n"
+	"-I, --incremental     Keep sprites that didn't change at the position they have in\n"
+	"                      the json file from the previous run and only pack new or\n"
+	"                      resized sprites. Packs from scratch if they don't fit, or\n"
+	"                      if the previous run wrote several pages.\n"
 	"-i, --indentation     Number of spaces for indentation, 0 to use tabs (default).\n"
 	"-u, --premultiplied   Atlas images will have premultiplied alpha.\n"
 	"-b, --alpha-bleeding  Post-process atlas image with an alpha bleeding algorithm.\n"
+	"-B, --sprite-bleeding Like --alpha-bleeding, but each sprite only bleeds into the\n"
+	"                      padding around it (half of it on each side), so empty\n"
+	"                      areas of the atlas are left alone. Sprites are processed\n"
+	"                      in parallel.\n"
 	"-M, --mode            Specifies the packing heuristic. Allowed values are:\n"
 	"                        * auto (default; tries all modes and selects one)\n"
 	"                        * bottom-left\n"
@@ -27,11 +35,42 @@ const char *help_text =
 	"                        * long-side\n"
 	"                        * best-area\n"
 	"                        * contact-point\n"
+	"                        * skyline-bottom-left (much faster, less dense)\n"
+	"                        * skyline-min-waste (much faster, less dense)\n"
+	"                        * guillotine (faster, less dense)\n"
+	"-O, --sort            Order in which sprites are placed. Allowed values are:\n"
+	"                        * auto (default; each heuristic picks its own)\n"
+	"                        * area\n"
+	"                        * max-side\n"
+	"                        * perimeter\n"
+	"                        * height\n"
+	"                      Placing in order is much faster with the MaxRects modes\n"
+	"                      (bottom-left to contact-point), usually a bit less dense.\n"
+	"-T, --search-budget   Milliseconds to spend searching for the smallest atlas,\n"
+	"                      trying square, wide and tall pages with the heuristics of\n"
+	"                      --mode and the orders of --sort (all of them for auto).\n"
+	"                      Default is 0 (no search). Incremental repacks keep the\n"
+	"                      previous atlas size and don't search.\n"
 	"-f, --format          Specifies the output format of the JSON file. Values are:\n"
 	"                        * legacy (default; uses the original JSON format created by urraka)\n"
 	"                        * jsonhash (Texture Atlas JSON Hash format)\n"
 	"                        * jsonarray (Texture Atlas JSON Array format)\n"
 	"                        * xml (Texture Atlas XML)\n"
+	"-j, --jobs            Number of threads to use, 0 for one per core (default).\n"
+	"-k, --keep-decoded    Memory in MiB for keeping decoded sprites between reading\n"
+	"                      and writing them, so each image is only decoded once.\n"
+	"                      Sprites over the limit go to a temporary file. Default is\n"
+	"                      0 (disabled).\n"
+	"-c, --cache           File used to cache image sizes and trim rects between runs.\n"
+	"                      Only new or modified images are read again.\n"
+	"-z, --compression     PNG compression level from 0 (none) to 9 (smallest). Default\n"
+	"                      is set by --png-speed. Atlas images are compressed in\n"
+	"                      parallel strips.\n"
+	"-Z, --png-speed       PNG encoding preset. Values are:\n"
+	"                        * fast (level 1, sub filter on every row)\n"
+	"                        * default (level 6, filter with the smallest sum of\n"
+	"                          differences per row)\n"
+	"                        * max (level 9, per-row filter search, slower)\n"
 	"\n"
 	"(*) The format of the metadata file should be as follows:\n"
 	"\n"
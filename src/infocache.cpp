@@ -0,0 +1,287 @@
+#include "infocache.h"
+
+#include "rapidjson/document.h"
+#include "rapidjson/filereadstream.h"
+#include "rapidjson/filewritestream.h"
+#include "rapidjson/writer.h"
+
+#include <cstdio>
+#include <ctime>
+#include <sys/stat.h>
+
+static const int cache_version = 1;
+
+static bool file_stat(const char *path, int64_t *mtime, uint64_t *size)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) != 0)
+		return false;
+
+	*mtime = sb.st_mtime;
+	*size = sb.st_size;
+
+	return true;
+}
+
+// FNV-1a
+static const uint64_t hash_seed = 14695981039346656037ULL;
+
+static uint64_t hash_bytes(uint64_t h, const uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		h ^= data[i];
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+static bool file_hash(const char *path, uint64_t *hash)
+{
+	FILE *file = fopen(path, "rb");
+
+	if (file == 0)
+		return false;
+
+	uint64_t h = hash_seed;
+
+	uint8_t buffer[65536];
+	size_t n;
+
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		h = hash_bytes(h, buffer, n);
+
+	bool success = !ferror(file);
+	fclose(file);
+
+	*hash = h;
+
+	return success;
+}
+
+InfoCache::Entry::Entry()
+{
+	mtime = -1;
+	size = 0;
+	hash = 0;
+
+	width = 0;
+	height = 0;
+	channels = 0;
+
+	trimmed = false;
+	xoffset = 0;
+	yoffset = 0;
+	trim_width = 0;
+	trim_height = 0;
+}
+
+InfoCache::InfoCache()
+{
+	start_time_ = time(0);
+}
+
+bool InfoCache::stamp(const char *path, Entry *entry)
+{
+	return file_stat(path, &entry->mtime, &entry->size);
+}
+
+bool InfoCache::hash(const uint8_t *data, size_t size, Entry *entry)
+{
+	if (size != entry->size)
+		return false;
+
+	entry->hash = hash_bytes(hash_seed, data, size);
+
+	return true;
+}
+
+bool InfoCache::lookup(const char *path, Entry *entry) const
+{
+	std::map<std::string, Entry>::const_iterator it = entries_.find(path);
+
+	if (it == entries_.end())
+		return false;
+
+	int64_t mtime;
+	uint64_t size;
+
+	if (!file_stat(path, &mtime, &size) || size != it->second.size)
+		return false;
+
+	*entry = it->second;
+
+	if (mtime == entry->mtime)
+		return true;
+
+	// touched but maybe not modified
+	uint64_t hash;
+
+	if (!file_hash(path, &hash) || hash != entry->hash)
+		return false;
+
+	entry->mtime = mtime;
+
+	return true;
+}
+
+void InfoCache::set(const char *path, const Entry &entry)
+{
+	entries_[path] = entry;
+}
+
+void InfoCache::clear()
+{
+	entries_.clear();
+}
+
+bool InfoCache::load(const char *filename)
+{
+	FILE *file = fopen(filename, "rb");
+
+	if (file == 0)
+		return false;
+
+	using namespace rapidjson;
+
+	Document document;
+
+	char buffer[4096];
+	FileReadStream stream(file, buffer, sizeof(buffer));
+	document.ParseStream(stream);
+	fclose(file);
+
+	if (document.HasParseError() || !document.IsObject())
+		return false;
+
+	Value::ConstMemberIterator version = document.FindMember("version");
+	Value::ConstMemberIterator files = document.FindMember("files");
+
+	if (version == document.MemberEnd() || !version->value.IsInt() ||
+		version->value.GetInt() != cache_version)
+		return false;
+
+	if (files == document.MemberEnd() || !files->value.IsObject())
+		return false;
+
+	for (Value::ConstMemberIterator it = files->value.MemberBegin(); it != files->value.MemberEnd(); ++it)
+	{
+		const Value &value = it->value;
+
+		if (!value.IsObject() || !value.HasMember("mtime") || !value.HasMember("size") ||
+			!value.HasMember("hash") || !value.HasMember("width") || !value.HasMember("height") ||
+			!value.HasMember("channels"))
+			continue;
+
+		if (!value["mtime"].IsInt64() || !value["size"].IsUint64() || !value["hash"].IsUint64() ||
+			!value["width"].IsInt() || !value["height"].IsInt() || !value["channels"].IsInt())
+			continue;
+
+		Entry entry;
+
+		entry.mtime = value["mtime"].GetInt64();
+		entry.size = value["size"].GetUint64();
+		entry.hash = value["hash"].GetUint64();
+		entry.width = value["width"].GetInt();
+		entry.height = value["height"].GetInt();
+		entry.channels = value["channels"].GetInt();
+
+		if (value.HasMember("trim"))
+		{
+			const Value &trim = value["trim"];
+
+			if (!trim.IsArray() || trim.Size() != 4 || !trim[0].IsInt() || !trim[1].IsInt() ||
+				!trim[2].IsInt() || !trim[3].IsInt())
+				continue;
+
+			entry.trimmed = true;
+			entry.xoffset = trim[0].GetInt();
+			entry.yoffset = trim[1].GetInt();
+			entry.trim_width = trim[2].GetInt();
+			entry.trim_height = trim[3].GetInt();
+		}
+
+		entries_[it->name.GetString()] = entry;
+	}
+
+	return true;
+}
+
+bool InfoCache::save(const char *filename) const
+{
+	FILE *file = fopen(filename, "wb");
+
+	if (file == 0)
+		return false;
+
+	using namespace rapidjson;
+
+	char buffer[4096];
+	FileWriteStream stream(file, buffer, sizeof(buffer));
+	Writer<FileWriteStream> writer(stream);
+
+	writer.StartObject();
+
+	writer.String("version");
+	writer.Int(cache_version);
+
+	writer.String("files");
+	writer.StartObject();
+
+	std::map<std::string, Entry>::const_iterator it;
+
+	for (it = entries_.begin(); it != entries_.end(); ++it)
+	{
+		const Entry &entry = it->second;
+
+		// files modified after the run started could change again within the same second
+		// without changing their mtime, so these get their hash checked next time
+		int64_t mtime = entry.mtime >= start_time_ ? -1 : entry.mtime;
+
+		writer.String(it->first.c_str());
+		writer.StartObject();
+
+		writer.String("mtime");
+		writer.Int64(mtime);
+
+		writer.String("size");
+		writer.Uint64(entry.size);
+
+		writer.String("hash");
+		writer.Uint64(entry.hash);
+
+		writer.String("width");
+		writer.Int(entry.width);
+
+		writer.String("height");
+		writer.Int(entry.height);
+
+		writer.String("channels");
+		writer.Int(entry.channels);
+
+		if (entry.trimmed)
+		{
+			writer.String("trim");
+			writer.StartArray();
+			writer.Int(entry.xoffset);
+			writer.Int(entry.yoffset);
+			writer.Int(entry.trim_width);
+			writer.Int(entry.trim_height);
+			writer.EndArray();
+		}
+
+		writer.EndObject();
+	}
+
+	writer.EndObject();
+	writer.EndObject();
+
+	stream.Flush();
+
+	bool success = !ferror(file);
+	fclose(file);
+
+	return success;
+}
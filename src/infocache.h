@@ -0,0 +1,55 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+// Persistent cache of image dimensions and trim rects, so unchanged files don't have to be
+// opened and decoded on every run. Entries are validated against the file's size and
+// modification time, and against a hash of its contents when the modification time differs.
+class InfoCache
+{
+public:
+	struct Entry
+	{
+		Entry();
+
+		int64_t mtime;
+		uint64_t size;
+		uint64_t hash;
+
+		int width;
+		int height;
+		int channels;
+
+		bool trimmed;
+		int xoffset;
+		int yoffset;
+		int trim_width;
+		int trim_height;
+	};
+
+	InfoCache();
+
+	bool load(const char *filename);
+	bool save(const char *filename) const;
+
+	// Fills entry with the cached info of the file at path if the file didn't change. This is
+	// safe to call from several threads as long as no set() calls are made at the same time.
+	bool lookup(const char *path, Entry *entry) const;
+
+	void set(const char *path, const Entry &entry);
+	void clear();
+
+	// Reads the modification time and size of a file. This comes before the file is read, so
+	// that changes made while reading it show up as a newer modification time.
+	static bool stamp(const char *path, Entry *entry);
+
+	// Sets the hash of a stamped file from the contents read after stamp(). Fails when they
+	// don't have the stamped size, which means the file changed in between.
+	static bool hash(const uint8_t *data, size_t size, Entry *entry);
+
+private:
+	std::map<std::string, Entry> entries_;
+	int64_t start_time_;
+};
@@ -22,11 +22,13 @@ int main(int argc, char *argv[])
 	struct option long_options[] = {
 		{"help",           no_argument,       0, 'h'},
 		{"alpha-bleeding", no_argument,       0, 'b'},
+		{"sprite-bleeding", no_argument,      0, 'B'},
 		{"premultiplied",  no_argument,       0, 'u'},
 		{"POT",            no_argument,       0, 'P'},
 		{"allow-rotate",   no_argument,       0, 'r'},
 		{"pretty",         no_argument,       0, 'e'},
 		{"trim",           no_argument,       0, 't'},
+		{"incremental",    no_argument,       0, 'I'},
 		{"max-size",       no_argument,       0, 'S'},
 		{"indentation",    required_argument, 0, 'i'},
 		{"output",         required_argument, 0, 'o'},
@@ -35,13 +37,20 @@ int main(int argc, char *argv[])
 		{"size",           required_argument, 0, 's'},
 		{"mode",           required_argument, 0, 'M'},
 		{"format",         required_argument, 0, 'f'},
+		{"jobs",           required_argument, 0, 'j'},
+		{"keep-decoded",   required_argument, 0, 'k'},
+		{"cache",          required_argument, 0, 'c'},
+		{"compression",    required_argument, 0, 'z'},
+		{"png-speed",      required_argument, 0, 'Z'},
+		{"sort",           required_argument, 0, 'O'},
+		{"search-budget",  required_argument, 0, 'T'},
 		{0, 0, 0, 0}
 	};
 
 	while (true)
 	{
 		int option_index = 0;
-		int code = getopt_long(argc, argv, "hbuPretSi:o:m:p:s:M:f:", long_options, &option_index);
+		int code = getopt_long(argc, argv, "hbBuPretSIi:o:m:p:s:M:f:j:k:c:z:Z:O:T:", long_options, &option_index);
 
 		if (code == -1)
 			break;
@@ -53,16 +62,21 @@ int main(int argc, char *argv[])
 				return 0;
 
 			case 'b': params.bleed = true;         break;
+			case 'B': params.sprite_bleed = true;  break;
 			case 'u': params.premultiplied = true; break;
 			case 'P': params.pot = true;           break;
 			case 'r': params.rotate = true;        break;
 			case 'e': params.pretty = true;        break;
 			case 't': params.trim = true;          break;
+			case 'I': params.incremental = true;   break;
 			case 'o': params.output = optarg;      break;
 			case 'm': params.metadata = optarg;    break;
 			case 'M': params.mode = optarg;        break;
+			case 'Z': params.png_speed = optarg;   break;
 			case 'S': params.max_size = true;      break;
 			case 'f': params.format = optarg;      break;
+			case 'c': params.cache = optarg;       break;
+			case 'O': params.sort = optarg;        break;
 
 			case 'i':
 				if (sscanf(optarg, "%d", &params.indentation) != 1)
@@ -88,6 +102,39 @@ int main(int argc, char *argv[])
 				}
 				break;
 
+			case 'j':
+				if (sscanf(optarg, "%d", &params.jobs) != 1 || params.jobs < 0)
+				{
+					fputs("Invalid value for jobs.\n", stderr);
+					return 1;
+				}
+				break;
+
+			case 'k':
+				if (sscanf(optarg, "%d", &params.keep_decoded) != 1 || params.keep_decoded < 0)
+				{
+					fputs("Invalid value for keep-decoded.\n", stderr);
+					return 1;
+				}
+				break;
+
+			case 'z':
+				if (sscanf(optarg, "%d", &params.compression) != 1 || params.compression < 0 ||
+					params.compression > 9)
+				{
+					fputs("Invalid value for compression.\n", stderr);
+					return 1;
+				}
+				break;
+
+			case 'T':
+				if (sscanf(optarg, "%d", &params.search_budget) != 1 || params.search_budget < 0)
+				{
+					fputs("Invalid value for search-budget.\n", stderr);
+					return 1;
+				}
+				break;
+
 			case 0:
 			case '?':
 			default:
@@ -2,6 +2,12 @@
 #include "bleeding.h"
 #include "png/png.h"
 #include "rbp/MaxRects.h"
+#include "rbp/Skyline.h"
+#include "rbp/Guillotine.h"
+#include "infocache.h"
+#include "pixels.h"
+#include "spritestore.h"
+#include "threadpool.h"
 
 #include "rapidjson/document.h"
 #include "rapidjson/filereadstream.h"
@@ -16,8 +22,15 @@
 #include <cstring>
 #include <vector>
 #include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <climits>
 #include <cmath>
 #include <cstdio>
+#include <functional>
 #include <stdint.h>
 #include <sys/stat.h>
 
@@ -35,9 +48,16 @@
 namespace pkr
 {
 
+// memory for the rows of the atlas being put together when writing it
+static const size_t band_bytes = 4 << 20;
+
+// memory for the atlas buffers of pages written at the same time, when the whole page is needed
+static const size_t page_memory = (size_t)1 << 30;
+
 struct Sprite
 {
 	const char *filename;
+	size_t index;
 
 	int x;
 	int y;
@@ -51,6 +71,17 @@ struct Sprite
 	int yoffset;
 };
 
+// A sprite decoded for copying into the atlas. pixels points to the top-left of the trimmed area
+// and rows are pitch bytes apart. data is 0 if the image couldn't be read.
+struct DecodedSprite
+{
+	const Sprite *sprite;
+	uint8_t *data;
+	const uint8_t *pixels;
+	int channels;
+	int pitch;
+};
+
 struct Result
 {
 	int width;
@@ -58,6 +89,103 @@ struct Result
 	std::vector<Sprite> sprites;
 };
 
+// One way of packing the sprites: a heuristic (a pack_mode value), the order the sprites are
+// placed in (a sort_mode value) and the shape of the pages when their size is searched.
+struct Strategy
+{
+	int mode;
+	int sort;
+	int shape;
+};
+
+// The best result of the strategies finished so far in auto mode, so the others can give up as
+// soon as they can't beat it. Fewer pages are better, then less area, then the strategy that
+// comes first.
+struct BestResult
+{
+	BestResult() : pages(SIZE_MAX), area(UINT64_MAX), order(SIZE_MAX), frozen_pages(SIZE_MAX),
+		frozen_area(UINT64_MAX), frozen_order(SIZE_MAX), timed(false) {}
+
+	// strategies still running past the deadline give up, once there's a result to fall back on
+	void set_deadline(int ms)
+	{
+		timed = true;
+		deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+	}
+
+	bool expired()
+	{
+		if (!timed)
+			return false;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (pages == SIZE_MAX)
+				return false;
+		}
+
+		return std::chrono::steady_clock::now() >= deadline;
+	}
+
+	// if a result with at least these pages and area from the heuristic at order would lose
+	bool beats(size_t pages, uint64_t area, size_t order)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return less(this->pages, this->area, this->order, pages, area, order);
+	}
+
+	// Keeps the best result so far for beats_frozen(), which unlike beats() doesn't change
+	// while strategies run, so what they do with it doesn't depend on which finish first.
+	void freeze()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		frozen_pages = pages;
+		frozen_area = area;
+		frozen_order = order;
+	}
+
+	bool beats_frozen(size_t pages, uint64_t area, size_t order)
+	{
+		return less(frozen_pages, frozen_area, frozen_order, pages, area, order);
+	}
+
+	void update(size_t pages, uint64_t area, size_t order)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (less(pages, area, order, this->pages, this->area, this->order))
+		{
+			this->pages = pages;
+			this->area = area;
+			this->order = order;
+		}
+	}
+
+	static bool less(size_t pages1, uint64_t area1, size_t order1, size_t pages2, uint64_t area2,
+		size_t order2)
+	{
+		if (pages1 != pages2)
+			return pages1 < pages2;
+
+		if (area1 != area2)
+			return area1 < area2;
+
+		return order1 < order2;
+	}
+
+	std::mutex mutex;
+	size_t pages;
+	uint64_t area;
+	size_t order;
+	size_t frozen_pages;
+	uint64_t frozen_area;
+	size_t frozen_order;
+	bool timed;
+	std::chrono::steady_clock::time_point deadline;
+};
+
 struct Packer
 {
 	int formatting;
@@ -72,7 +200,64 @@ struct Packer
 
 	rapidjson::Document metadata;
 
-	Packer(const Params &params) : params(params) {}
+	ThreadPool pool;
+	SpriteStore store;
+	InfoCache cache;
+
+	Packer(const Params &params) :
+		params(params),
+		pool(params.jobs),
+		store((size_t)params.keep_decoded << 20)
+	{}
+
+	// pack_mode values after the MaxRects heuristics, which use the values of rbp::MaxRects::Mode
+	enum
+	{
+		SkylineBottomLeft = rbp::MaxRects::ContactPoint + 1,
+		SkylineMinWaste,
+		Guillotine
+	};
+
+	// sort_mode values, 0 leaves the order to the heuristic
+	enum
+	{
+		SortArea = 1,
+		SortMaxSide,
+		SortPerimeter,
+		SortHeight
+	};
+
+	// page shapes for the size search, the other side is half of the searched size for wide
+	// and tall pages
+	enum
+	{
+		Square,
+		Wide,
+		Tall
+	};
+
+	// Creates the packer for a pack_mode value and sets bin_mode to the mode to insert with.
+	rbp::Bin *create_bin(int mode, int width, int height, int *bin_mode)
+	{
+		switch (mode)
+		{
+			case SkylineBottomLeft:
+				*bin_mode = rbp::Skyline::BottomLeft;
+				return new rbp::Skyline(width, height, params.rotate);
+
+			case SkylineMinWaste:
+				*bin_mode = rbp::Skyline::MinWaste;
+				return new rbp::Skyline(width, height, params.rotate);
+
+			case Guillotine:
+				*bin_mode = rbp::Guillotine::BestArea;
+				return new rbp::Guillotine(width, height, params.rotate);
+
+			default:
+				*bin_mode = mode;
+				return new rbp::MaxRects(width, height, params.rotate);
+		}
+	}
 
 	int pack_mode(const char *mode)
 	{
@@ -82,7 +267,10 @@ struct Packer
 			"long-side",
 			"best-area",
 			"bottom-left",
-			"contact-point"
+			"contact-point",
+			"skyline-bottom-left",
+			"skyline-min-waste",
+			"guillotine"
 		};
 
 		for (size_t i = 0; i < countof(modes); i++)
@@ -94,6 +282,25 @@ struct Packer
 		return -1;
 	}
 
+	int sort_mode(const char *sort)
+	{
+		static const char *sorts[] = {
+			"auto",
+			"area",
+			"max-side",
+			"perimeter",
+			"height"
+		};
+
+		for (size_t i = 0; i < countof(sorts); i++)
+		{
+			if (strcmp(sort, sorts[i]) == 0)
+				return i;
+		}
+
+		return -1;
+	}
+
 	int format_mode(const char *mode)
 	{
 		static const char *modes[] = {
@@ -112,6 +319,23 @@ struct Packer
 		return -1;
 	}
 
+	int png_speed_mode(const char *mode)
+	{
+		static const char *modes[] = {
+			"fast",
+			"default",
+			"max"
+		};
+
+		for (size_t i = 0; i < countof(modes); i++)
+		{
+			if (strcmp(mode, modes[i]) == 0)
+				return i;
+		}
+
+		return -1;
+	}
+
 	bool validate_params()
 	{
 		if (params.output == 0)
@@ -139,6 +363,12 @@ struct Packer
 			return false;
 		}
 
+		if (sort_mode(params.sort) == -1)
+		{
+			fputs("Invalid sort order.\n", stderr);
+			return false;
+		}
+
 		formatting = format_mode(params.format);
 		if (formatting == -1)
 		{
@@ -146,6 +376,12 @@ struct Packer
 			return false;
 		}
 
+		if (png_speed_mode(params.png_speed) == -1)
+		{
+			fputs("Invalid PNG speed.\n", stderr);
+			return false;
+		}
+
 		if (params.max_size && params.pot)
 		{
 			int w = 1;
@@ -291,89 +527,173 @@ struct Packer
 		}
 	}
 
-	bool read_trim_metrics(Sprite *sprite)
+	void apply_trim(Sprite *sprite, const AlphaBounds &bounds)
+	{
+		if (bounds.empty()) // fully transparent image, keep it 1x1
+		{
+			sprite->width = 1;
+			sprite->height = 1;
+			return;
+		}
+
+		sprite->xoffset = bounds.left;
+		sprite->yoffset = bounds.top;
+		sprite->width = (bounds.right - bounds.left) + 1;
+		sprite->height = (bounds.bottom - bounds.top) + 1;
+	}
+
+	void read_trim_metrics(Sprite *sprite, const uint8_t *data)
 	{
-		int w, h, channels;
+		const int w = sprite->real_width;
+		const int h = sprite->real_height;
 
-		uint8_t *data = png::load(sprite->filename, &w, &h, &channels);
+		AlphaBounds bounds;
 
-		if (data == 0)
+		for (int y = 0; y < h; y++)
+			bounds.add_row(data + (size_t)y * w * 4, y, w);
+
+		apply_trim(sprite, bounds);
+	}
+
+	bool read_trim_info(Sprite *sprite, const png::FileData &file, int *channels)
+	{
+		AlphaBounds bounds;
+
+		if (!png::trim_info(file.data(), file.size(), &sprite->real_width, &sprite->real_height, channels, &bounds))
 			return false;
 
 		sprite->xoffset = 0;
 		sprite->yoffset = 0;
-		sprite->width = w;
-		sprite->height = h;
-		sprite->real_width = w;
-		sprite->real_height = h;
+		sprite->width = sprite->real_width;
+		sprite->height = sprite->real_height;
 
-		if (channels != 4)
-			return delete[] data, true;
+		if (*channels == 4)
+			apply_trim(sprite, bounds);
+
+		return true;
+	}
 
-		int i, l, t, r, b; // left, top, right, bottom
-		int stride = 4 * w;
+	bool read_image(Sprite *sprite, const png::FileData &file, int *channels)
+	{
+		uint8_t *data = png::load(file.data(), file.size(), &sprite->real_width, &sprite->real_height, channels);
 
-		// top
-		for (t = 0, i = 3; t < h; t++)
-		{
-			uint8_t value = 0;
+		if (data == 0)
+			return false;
 
-			for (int x = 0; x < w; x++, i += 4)
-				value |= data[i];
+		sprite->xoffset = 0;
+		sprite->yoffset = 0;
+		sprite->width = sprite->real_width;
+		sprite->height = sprite->real_height;
 
-			if (value != 0)
-				break;
-		}
+		if (params.trim && *channels == 4)
+			read_trim_metrics(sprite, data);
 
-		if (t == h) // fully transparent image, keep it 1x1
+		// keep the trimmed pixels so the image doesn't need to be decoded again later
+		if (store.enabled())
 		{
-			sprite->width = 1;
-			sprite->height = 1;
-			return delete[] data, true;
+			const int pitch = sprite->real_width * (*channels);
+			const uint8_t *src = data + sprite->yoffset * pitch + sprite->xoffset * (*channels);
+
+			store.put(sprite->index, src, sprite->width, sprite->height, *channels, pitch);
 		}
 
-		// bottom
-		for (b = h - 1, i = b * stride + 3; b > t; b--, i -= stride)
-		{
-			uint8_t value = 0;
+		delete[] data;
 
-			for (int x = 0, j = i; x < w; x++, j += 4)
-				value |= data[j];
+		return true;
+	}
 
-			if (value != 0)
-				break;
-		}
+	// cached is set when info can go to the cache file.
+	bool load_sprite_info(size_t index, InfoCache::Entry *info, char *cached)
+	{
+		Sprite &sprite = input_sprites[index];
+		rbp::RectSize &rect = input_rects[index];
 
-		// left
-		for (l = 0, i = t * stride + 3; l < w; l++, i += 4)
+		sprite.filename = filenames[index];
+		sprite.index = index;
+
+		if (params.cache != 0 && cache.lookup(sprite.filename, info) && (info->trimmed || !params.trim))
 		{
-			uint8_t value = 0;
+			*cached = true;
 
-			for (int y = t, j = i; y <= b; y++, j += stride)
-				value |= data[j];
+			sprite.real_width = info->width;
+			sprite.real_height = info->height;
 
-			if (value != 0)
-				break;
+			if (params.trim)
+			{
+				sprite.xoffset = info->xoffset;
+				sprite.yoffset = info->yoffset;
+				sprite.width = info->trim_width;
+				sprite.height = info->trim_height;
+			}
+			else
+			{
+				sprite.xoffset = 0;
+				sprite.yoffset = 0;
+				sprite.width = sprite.real_width;
+				sprite.height = sprite.real_height;
+			}
 		}
-
-		// right
-		for (r = w - 1, i = (t + 1) * stride - 1; r > l; r--, i -= 4)
+		else
 		{
-			uint8_t value = 0;
+			// stamped before reading and hashed from the same contents that get decoded, so a
+			// file rewritten meanwhile can't get the info of its old contents cached
+			*info = InfoCache::Entry();
+			*cached = params.cache != 0 && InfoCache::stamp(sprite.filename, info);
 
-			for (int y = t, j = i; y <= b; y++, j += stride)
-				value |= data[j];
+			// when neither the pixels nor the hash are needed, only the chunks before the image
+			// data are read, so mapping pays off for smaller files
+			const bool whole = store.enabled() || params.trim || *cached;
+			png::FileData file;
 
-			if (value != 0)
-				break;
+			if (!file.open(sprite.filename, whole ? 1 << 20 : 65536))
+				return false;
+
+			*cached = *cached && InfoCache::hash(file.data(), file.size(), info);
+
+			int channels;
+
+			if (store.enabled())
+			{
+				if (!read_image(&sprite, file, &channels))
+					return false;
+			}
+			else if (params.trim)
+			{
+				if (!read_trim_info(&sprite, file, &channels))
+					return false;
+			}
+			else
+			{
+				if (!png::info(file.data(), file.size(), &sprite.real_width, &sprite.real_height, &channels))
+					return false;
+
+				sprite.xoffset = 0;
+				sprite.yoffset = 0;
+				sprite.width = sprite.real_width;
+				sprite.height = sprite.real_height;
+			}
+
+			if (*cached)
+			{
+				info->width = sprite.real_width;
+				info->height = sprite.real_height;
+				info->channels = channels;
+
+				if (params.trim)
+				{
+					info->trimmed = true;
+					info->xoffset = sprite.xoffset;
+					info->yoffset = sprite.yoffset;
+					info->trim_width = sprite.width;
+					info->trim_height = sprite.height;
+				}
+			}
 		}
 
-		sprite->xoffset = l;
-		sprite->yoffset = t;
-		sprite->width = (r - l) + 1;
-		sprite->height = (b - t) + 1;
+		rect.width = sprite.width + params.padding;
+		rect.height = sprite.height + params.padding;
 
-		return delete[] data, true;
+		return true;
 	}
 
 	bool load_sprites_info()
@@ -381,37 +701,48 @@ struct Packer
 		input_sprites.resize(filenames.size());
 		input_rects.resize(filenames.size());
 
-		for (size_t i = 0; i < filenames.size(); i++)
-		{
-			Sprite &sprite = input_sprites[i];
-			rbp::RectSize &rect = input_rects[i];
+		if (params.cache != 0)
+			cache.load(params.cache);
 
-			sprite.filename = filenames[i];
+		// files are read in parallel, errors are reported afterwards in input order
+		std::vector<char> loaded(filenames.size());
+		std::vector<char> cached(filenames.size());
+		std::vector<InfoCache::Entry> infos(filenames.size());
 
-			if (params.trim)
+		pool.run(filenames.size(), [&](size_t i) {
+			loaded[i] = load_sprite_info(i, &infos[i], &cached[i]);
+		});
+
+		bool success = true;
+
+		for (size_t i = 0; i < filenames.size(); i++)
+		{
+			if (!loaded[i])
 			{
-				if (!read_trim_metrics(&sprite))
-				{
+				if (params.trim)
 					fprintf(stderr, "Error reading image %s\n", filenames[i]);
-					return false;
-				}
-			}
-			else
-			{
-				if (!png::info(sprite.filename, &sprite.real_width, &sprite.real_height))
-				{
+				else
 					fprintf(stderr, "Error reading image info from %s\n", filenames[i]);
-					return false;
-				}
 
-				sprite.xoffset = 0;
-				sprite.yoffset = 0;
-				sprite.width = sprite.real_width;
-				sprite.height = sprite.real_height;
+				success = false;
+			}
+		}
+
+		if (!success)
+			return false;
+
+		if (params.cache != 0)
+		{
+			cache.clear();
+
+			for (size_t i = 0; i < filenames.size(); i++)
+			{
+				if (cached[i])
+					cache.set(filenames[i], infos[i]);
 			}
 
-			rect.width = sprite.width + params.padding;
-			rect.height = sprite.height + params.padding;
+			if (!cache.save(params.cache))
+				fprintf(stderr, "Failed to write cache file (%s).\n", params.cache);
 		}
 
 		if (params.width > 0 && params.height > 0)
@@ -481,175 +812,884 @@ struct Packer
 
 		int mode = pack_mode(params.mode);
 
-		if (mode == 0)
-		{
-			int modes[] = {
-				rbp::MaxRects::BottomLeft,
-				rbp::MaxRects::ShortSide,
-				rbp::MaxRects::LongSide,
-				rbp::MaxRects::BestArea,
-				rbp::MaxRects::ContactPoint
-			};
+		if (params.incremental && compute_incremental_results(mode, result))
+			return result;
 
-			std::vector<Result*> best;
-			uint64_t best_area = 0;
+		std::vector<Strategy> strategies = list_strategies(mode, sort_mode(params.sort),
+			params.search_budget > 0);
 
-			for (size_t i = 0; i < countof(modes); i++)
-			{
-				std::vector<Result*> res = compute_result(modes[i]);
+		if (strategies.size() == 1)
+		{
+			uint64_t area;
+			return compute_result(strategies[0], 0, 0, &area);
+		}
 
-				uint64_t area = 0;
+		// strategies are independent, run them all and pick the best in the order they're listed,
+		// the ones that fall behind the best so far are given up on and return nothing
+		std::vector<std::vector<Result*> > results(strategies.size());
+		std::vector<uint64_t> areas(strategies.size());
+		BestResult bound;
 
-				for (size_t j = 0; j < res.size(); j++)
-					area += res[j]->width * res[j]->height;
+		if (params.search_budget > 0)
+			bound.set_deadline(params.search_budget);
 
-				if (best.size() == 0 || res.size() < best.size() ||
-					(res.size() == best.size() && area < best_area))
-				{
-					for (size_t j = 0; j < best.size(); j++)
-						delete best[j];
+		// strategies run in batches of the same cost, cheapest first, and the size search can
+		// cap its attempts at what beats the results of earlier batches
+		std::vector<size_t> batch;
 
-					best.swap(res);
-					best_area = area;
-				}
-				else
-				{
-					for (size_t j = 0; j < res.size(); j++)
-						delete res[j];
-				}
+		for (int cost = 0; cost <= max_strategy_cost; cost++)
+		{
+			batch.clear();
+
+			for (size_t i = 0; i < strategies.size(); i++)
+			{
+				if (strategy_cost(strategies[i]) == cost)
+					batch.push_back(i);
 			}
 
-			result.swap(best);
+			bound.freeze();
+
+			pool.run(batch.size(), [&](size_t i) {
+				results[batch[i]] = compute_result(strategies[batch[i]], &bound, batch[i], &areas[batch[i]]);
+			});
 		}
-		else
+
+		uint64_t best_area = 0;
+
+		for (size_t i = 0; i < strategies.size(); i++)
 		{
-			result = compute_result(mode);
+			std::vector<Result*> &res = results[i];
+
+			if (res.size() > 0 && (result.size() == 0 || res.size() < result.size() ||
+				(res.size() == result.size() && areas[i] < best_area)))
+			{
+				for (size_t j = 0; j < result.size(); j++)
+					delete result[j];
+
+				result.swap(res);
+				best_area = areas[i];
+			}
+			else
+			{
+				for (size_t j = 0; j < res.size(); j++)
+					delete res[j];
+			}
 		}
 
 		return result;
 	}
 
-	std::vector<Result*> compute_result(int mode)
+	// Lists the strategies for a pack_mode and a sort_mode value, where 0 means all of them. Without
+	// search, auto mode tries each heuristic in the given order. With it, every order and page
+	// shape is tried too, cheapest first so that the budget gets through as many as possible.
+	std::vector<Strategy> list_strategies(int mode, int sort, bool search)
 	{
-		std::vector<Result*> results;
-
-		std::vector<rbp::Rect> result_rects;
-		std::vector<size_t> result_indices;
-		std::vector<size_t> input_indices(input_rects.size());
-		std::vector<size_t> rects_indices;
+		static const int auto_modes[] = {
+			rbp::MaxRects::BottomLeft,
+			rbp::MaxRects::ShortSide,
+			rbp::MaxRects::LongSide,
+			rbp::MaxRects::BestArea,
+			rbp::MaxRects::ContactPoint,
+			SkylineBottomLeft,
+			SkylineMinWaste,
+			Guillotine
+		};
 
-		for (size_t i = 0; i < input_rects.size(); i++)
-			input_indices[i] = i;
+		std::vector<int> modes;
 
-		int w = 0;
-		int h = 0;
+		if (mode == 0)
+			modes.assign(auto_modes, auto_modes + countof(auto_modes));
+		else
+			modes.push_back(mode);
 
-		calculate_initial_size(input_indices, &w, &h);
+		std::vector<Strategy> strategies;
 
-		while (input_indices.size() > 0)
+		if (!search)
 		{
-			rects_indices = input_indices;
+			for (size_t i = 0; i < modes.size(); i++)
+			{
+				Strategy strategy = { modes[i], sort, Square };
+				strategies.push_back(strategy);
+			}
+
+			return strategies;
+		}
 
-			rbp::MaxRects packer(w - params.padding, h - params.padding, params.rotate);
+		std::vector<int> sorts;
 
-			packer.insert(mode, input_rects, rects_indices, result_rects, result_indices);
+		if (sort == 0)
+		{
+			for (int i = 0; i <= SortHeight; i++)
+				sorts.push_back(i);
+		}
+		else
+		{
+			sorts.push_back(sort);
+		}
 
-			bool add_result = false;
+		// only the size search has a say in the shape of the pages
+		const int shapes = has_fixed_size() || params.pot ? 1 : 3;
 
-			if (rects_indices.size() > 0)
+		for (int cost = 0; cost <= max_strategy_cost; cost++)
+		{
+			for (int shape = 0; shape < shapes; shape++)
 			{
-				if (can_enlarge(w, h))
+				for (size_t i = 0; i < sorts.size(); i++)
 				{
-					if (params.max_size)
+					for (size_t j = 0; j < modes.size(); j++)
 					{
-						int *x = 0;
-
-						if (w > h)
-							x = h < params.height ? &h : &w;
-						else
-							x = w < params.width ? &w : &h;
-
-						int max = x == &w ? params.width : params.height;
+						Strategy strategy = { modes[j], sorts[i], shape };
 
-						*x = std::min(*x * 2, max);
-					}
-					else
-					{
-						if (w > h)
-							h *= 2;
-						else
-							w *= 2;
+						if (strategy_cost(strategy) == cost)
+							strategies.push_back(strategy);
 					}
 				}
-				else
-				{
-					add_result = true;
-					input_indices.swap(rects_indices);
-				}
 			}
+		}
+
+		return strategies;
+	}
+
+	static const int max_strategy_cost = 4;
+
+	// Skyline and guillotine, then MaxRects placing in order, then picking the best rect at every
+	// step, then contact point the same two ways.
+	int strategy_cost(const Strategy &strategy)
+	{
+		if (strategy.mode >= SkylineBottomLeft)
+			return 0;
+
+		int cost = strategy.sort != 0 ? 1 : 2;
+		return strategy.mode == rbp::MaxRects::ContactPoint ? cost + 2 : cost;
+	}
+
+	// Sorts indices by a sort_mode value, largest first with ties broken by the other side.
+	void sort_indices(int sort, std::vector<size_t> &indices)
+	{
+		auto key = [&](size_t i, uint64_t &first, int &second)
+		{
+			const rbp::RectSize &rc = input_rects[i];
+
+			switch (sort)
+			{
+				case SortArea:
+					first = (uint64_t)rc.width * rc.height;
+					second = std::max(rc.width, rc.height);
+					break;
+
+				case SortMaxSide:
+					first = std::max(rc.width, rc.height);
+					second = std::min(rc.width, rc.height);
+					break;
+
+				case SortPerimeter:
+					first = (uint64_t)rc.width + rc.height;
+					second = std::max(rc.width, rc.height);
+					break;
+
+				default:
+					first = rc.height;
+					second = rc.width;
+					break;
+			}
+		};
+
+		std::stable_sort(indices.begin(), indices.end(), [&](size_t a, size_t b) {
+			uint64_t first_a, first_b;
+			int second_a, second_b;
+
+			key(a, first_a, second_a);
+			key(b, first_b, second_b);
+
+			if (first_a != first_b)
+				return first_a > first_b;
+
+			return second_a > second_b;
+		});
+	}
+
+	// Packs all of the sprites with one strategy. area is the total size of the pages before
+	// they're cropped, which is what the size search minimizes. With a bound, gives up and
+	// returns nothing as soon as the result would be worse than the best one, with order
+	// breaking ties, or once its deadline has passed.
+	std::vector<Result*> compute_result(const Strategy &strategy, BestResult *bound, size_t order,
+		uint64_t *area)
+	{
+		std::vector<Result*> results;
+
+		std::vector<rbp::Rect> result_rects;
+		std::vector<size_t> result_indices;
+		std::vector<size_t> input_indices(input_rects.size());
+
+		for (size_t i = 0; i < input_rects.size(); i++)
+			input_indices[i] = i;
+
+		// the sprites left for later pages stay in this order
+		if (strategy.sort != 0)
+			sort_indices(strategy.sort, input_indices);
+
+		*area = 0;
+
+		while (input_indices.size() > 0)
+		{
+			int w = 0;
+			int h = 0;
+
+			// page_area is the least the current page can end up with
+			auto losing = [&](uint64_t page_area) -> bool
+			{
+				return bound != 0 && (bound->expired() ||
+					bound->beats(results.size() + 1, *area + page_area, order));
+			};
+
+			// same against the results of earlier batches
+			auto outclassed = [&](uint64_t page_area) -> bool
+			{
+				return bound != 0 && bound->beats_frozen(results.size() + 1, *area + page_area, order);
+			};
+
+			bool packed;
+
+			// power of two sizes are few enough to just try them in order
+			if (has_fixed_size() || params.pot)
+				packed = grow_size(strategy, input_indices, &w, &h, result_rects, result_indices, losing);
 			else
+				packed = search_size(strategy, input_indices, &w, &h, result_rects, result_indices, losing,
+					outclassed);
+
+			if (!packed)
 			{
-				add_result = true;
-				input_indices.clear();
+				for (size_t i = 0; i < results.size(); i++)
+					delete results[i];
+
+				results.clear();
+				return results;
 			}
 
-			if (add_result)
+			Result *result = create_result(w, h, result_rects, result_indices,
+				!has_fixed_size() && !params.pot);
+
+			results.push_back(result);
+			*area += (uint64_t)w * h;
+		}
+
+		if (bound != 0)
+			bound->update(results.size(), *area, order);
+
+		return results;
+	}
+
+	// Packs the rects in indices into one page, doubling its size until they fit or it can't be
+	// enlarged anymore. The rects that didn't fit are left in indices. Returns false if it gave
+	// up because of losing.
+	bool grow_size(const Strategy &strategy, std::vector<size_t> &indices, int *w, int *h,
+		std::vector<rbp::Rect> &result_rects, std::vector<size_t> &result_indices,
+		const std::function<bool(uint64_t)> &losing)
+	{
+		std::vector<size_t> rects_indices;
+
+		calculate_initial_size(indices, w, h);
+
+		while (true)
+		{
+			// pages only get larger from here
+			const uint64_t page_area = (uint64_t)*w * *h;
+
+			if (losing(page_area))
+				return false;
+
+			rects_indices = indices;
+
+			int bin_mode;
+			std::unique_ptr<rbp::Bin> bin(create_bin(strategy.mode, *w - params.padding,
+				*h - params.padding, &bin_mode));
+
+			bin->set_ordered(strategy.sort != 0);
+			bin->insert(bin_mode, input_rects, rects_indices, result_rects, result_indices, false,
+				[&]() { return losing(page_area); });
+
+			if (losing(page_area))
+				return false;
+
+			if (rects_indices.size() == 0 || !can_enlarge(*w, *h))
+				break;
+
+			if (params.max_size)
 			{
-				Result *result = new Result();
+				int *x = 0;
 
-				result->width = w;
-				result->height = h;
+				if (*w > *h)
+					x = *h < params.height ? h : w;
+				else
+					x = *w < params.width ? w : h;
 
-				result->sprites.resize(result_rects.size());
+				int max = x == w ? params.width : params.height;
 
-				int xmin = w;
-				int xmax = 0;
-				int ymin = h;
-				int ymax = 0;
+				*x = std::min(*x * 2, max);
+			}
+			else
+			{
+				if (*w > *h)
+					*h *= 2;
+				else
+					*w *= 2;
+			}
+		}
 
-				for (size_t i = 0; i < result_rects.size(); i++)
-				{
-					size_t index = result_indices[i];
+		indices.swap(rects_indices);
+
+		return true;
+	}
+
+	// Packs the rects in indices into the smallest page of the strategy's shape they fit in
+	// (clipped to the maximum size). Sizes below the area of the rects or their longest side can't
+	// work, so the search grows from there until everything fits, then bisects between the
+	// largest size that failed and the smallest that worked. Attempts stop at the first rect that
+	// doesn't fit. If they don't fit at the maximum size, the page is filled at that size and the
+	// rest are left in indices. Attempts are capped at the sizes that aren't outclassed by the
+	// results of earlier batches. Returns false if it gave up because of losing.
+	bool search_size(const Strategy &strategy, std::vector<size_t> &indices, int *w, int *h,
+		std::vector<rbp::Rect> &result_rects, std::vector<size_t> &result_indices,
+		const std::function<bool(uint64_t)> &losing, const std::function<bool(uint64_t)> &outclassed)
+	{
+		uint64_t area = 0;
+		int widest = 0;
+		int tallest = 0;
+		int longest = 0;
+		int shortest = 0;
 
-					const rbp::RectSize &base_rect = input_rects[index];
-					const Sprite &base_sprite = input_sprites[index];
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			const rbp::RectSize &rc = input_rects[indices[i]];
 
-					Sprite &sprite = result->sprites[i];
+			area += (uint64_t)rc.width * rc.height;
+			widest = std::max(widest, rc.width);
+			tallest = std::max(tallest, rc.height);
+			longest = std::max(longest, std::max(rc.width, rc.height));
+			shortest = std::max(shortest, std::min(rc.width, rc.height));
+		}
 
-					sprite = base_sprite;
-					sprite.x = result_rects[i].x + params.padding;
-					sprite.y = result_rects[i].y + params.padding;
-					sprite.rotated = (result_rects[i].width != base_rect.width);
+		const int shape = strategy.shape;
 
-					xmin = std::min(xmin, result_rects[i].x);
-					xmax = std::max(xmax, result_rects[i].x + result_rects[i].width);
-					ymin = std::min(ymin, result_rects[i].y);
-					ymax = std::max(ymax, result_rects[i].y + result_rects[i].height);
-				}
+		auto page_width = [&](int size)
+		{
+			int width = shape == Tall ? size / 2 : size;
+			return params.max_size ? std::min(width, params.width) : width;
+		};
 
-				if (!has_fixed_size() && !params.pot)
-				{
-					result->width = (xmax - xmin) + params.padding;
-					result->height = (ymax - ymin) + params.padding;
+		auto page_height = [&](int size)
+		{
+			int height = shape == Wide ? size / 2 : size;
+			return params.max_size ? std::min(height, params.height) : height;
+		};
 
-					if (xmin > 0 || ymin > 0)
-					{
-						for (size_t i = 0; i < result->sprites.size(); i++)
-						{
-							result->sprites[i].x -= xmin;
-							result->sprites[i].y -= ymin;
-						}
-					}
+		// the smallest size whose page reaches a right and bottom edge
+		auto size_for = [&](int right, int bottom)
+		{
+			return std::max(shape == Tall ? right * 2 : right, shape == Wide ? bottom * 2 : bottom);
+		};
+
+		const int limit = params.max_size ? size_for(params.width, params.height) : INT_MAX / 2;
+
+		// a page needs room for the area of the rects and for each of them on its own
+		auto possible = [&](int size) -> bool
+		{
+			const int bw = page_width(size) - params.padding;
+			const int bh = page_height(size) - params.padding;
+
+			if (bw <= 0 || bh <= 0 || (uint64_t)bw * bh < area)
+				return false;
+
+			if (params.rotate)
+				return std::min(bw, bh) >= shortest && std::max(bw, bh) >= longest;
+
+			return bw >= widest && bh >= tallest;
+		};
+
+		int low = 1;
+		int high = limit;
+
+		while (low < high)
+		{
+			int mid = low + (high - low) / 2;
+
+			if (possible(mid))
+				high = mid;
+			else
+				low = mid + 1;
+		}
+
+		auto page_area = [&](int size) { return (uint64_t)page_width(size) * page_height(size); };
+
+		// the page ends up at least as large as low
+		auto low_losing = [&]() { return losing(page_area(low)); };
+
+		// Lowers size to the largest one that beats the results of earlier batches. If the rects
+		// don't fit there, larger sizes can't win either, so heuristics that lose give up after
+		// one attempt instead of bisecting down to a size that loses anyway.
+		auto winnable = [&](int size) -> int
+		{
+			if (!outclassed(page_area(size)) || outclassed(page_area(low)))
+				return size;
+
+			int fine = low;
+
+			while (size - fine > 1)
+			{
+				int mid = fine + (size - fine) / 2;
+
+				if (outclassed(page_area(mid)))
+					size = mid;
+				else
+					fine = mid;
+			}
+
+			return fine;
+		};
+
+		std::vector<rbp::Rect> rects;
+		std::vector<size_t> placed;
+		std::vector<size_t> rects_indices;
+
+		// area of the rects placed by the last attempt and the size of the page they ended up in
+		uint64_t placed_area = 0;
+		int extent = 0;
+
+		// keeps the packing in the result when all of the rects fit, or always with partial
+		auto fits = [&](int size, bool partial) -> bool
+		{
+			rects_indices = indices;
+
+			int bin_mode;
+			std::unique_ptr<rbp::Bin> bin(create_bin(strategy.mode, page_width(size) - params.padding,
+				page_height(size) - params.padding, &bin_mode));
+
+			bin->set_ordered(strategy.sort != 0);
+			bin->insert(bin_mode, input_rects, rects_indices, rects, placed, !partial, low_losing);
+
+			int right = 0;
+			int bottom = 0;
+
+			placed_area = 0;
+
+			for (size_t i = 0; i < rects.size(); i++)
+			{
+				placed_area += (uint64_t)rects[i].width * rects[i].height;
+				right = std::max(right, rects[i].x + rects[i].width);
+				bottom = std::max(bottom, rects[i].y + rects[i].height);
+			}
+
+			extent = size_for(right + params.padding, bottom + params.padding);
+
+			if (rects_indices.size() > 0 && !partial)
+				return false;
+
+			result_rects.swap(rects);
+			result_indices.swap(placed);
+
+			return true;
+		};
+
+		if (low_losing())
+			return false;
+
+		// packings are rarely more than 90% dense, so starting at the lower bound is a wasted attempt
+		int size = winnable(std::min(low + low / 16, limit));
+
+		while (!fits(size, false))
+		{
+			if (size == limit)
+			{
+				if (low_losing() || !fits(size, true) || low_losing())
+					return false;
+
+				*w = page_width(size);
+				*h = page_height(size);
+				indices.swap(rects_indices);
+
+				return true;
+			}
+
+			low = size + 1;
+
+			if (low_losing())
+				return false;
+
+			// guess that the rest packs as densely as what was placed
+			double scale = placed_area > 0 ? std::sqrt((double)area / placed_area) * 1.02 : 2;
+			size = std::min((int)(size * std::min(scale, 2.0)), limit);
+			size = winnable(std::max(size, low));
+		}
+
+		high = std::max(std::min(size, extent), low);
+
+		// within a percent of the smallest size is close enough to not be worth more attempts,
+		// unless there's a budget for searching
+		while (high - low > (params.search_budget > 0 ? 0 : high / 128))
+		{
+			int mid = winnable(low + (high - low) / 2);
+
+			if (fits(mid, false))
+			{
+				high = std::max(std::min(mid, extent), low);
+			}
+			else
+			{
+				low = mid + 1;
+
+				if (low_losing())
+					return false;
+			}
+		}
+
+		*w = page_width(high);
+		*h = page_height(high);
+		indices.clear();
+
+		return true;
+	}
+
+	Result *create_result(int w, int h, const std::vector<rbp::Rect> &result_rects,
+		const std::vector<size_t> &result_indices, bool crop)
+	{
+		Result *result = new Result();
+
+		result->width = w;
+		result->height = h;
+
+		result->sprites.resize(result_rects.size());
+
+		int xmin = w;
+		int xmax = 0;
+		int ymin = h;
+		int ymax = 0;
+
+		for (size_t i = 0; i < result_rects.size(); i++)
+		{
+			size_t index = result_indices[i];
+
+			const rbp::RectSize &base_rect = input_rects[index];
+			const Sprite &base_sprite = input_sprites[index];
+
+			Sprite &sprite = result->sprites[i];
+
+			sprite = base_sprite;
+			sprite.x = result_rects[i].x + params.padding;
+			sprite.y = result_rects[i].y + params.padding;
+			sprite.rotated = (result_rects[i].width != base_rect.width);
+
+			xmin = std::min(xmin, result_rects[i].x);
+			xmax = std::max(xmax, result_rects[i].x + result_rects[i].width);
+			ymin = std::min(ymin, result_rects[i].y);
+			ymax = std::max(ymax, result_rects[i].y + result_rects[i].height);
+		}
+
+		if (crop)
+		{
+			result->width = (xmax - xmin) + params.padding;
+			result->height = (ymax - ymin) + params.padding;
+
+			if (xmin > 0 || ymin > 0)
+			{
+				for (size_t i = 0; i < result->sprites.size(); i++)
+				{
+					result->sprites[i].x -= xmin;
+					result->sprites[i].y -= ymin;
 				}
+			}
+		}
+
+		return result;
+	}
+
+	struct Placement
+	{
+		int x;
+		int y;
+		int width;
+		int height;
+		bool rotated;
+		size_t position; // in the previous layout
+	};
+
+	bool read_placement(const rapidjson::Value &value, bool legacy, Placement *placement)
+	{
+		if (!value.IsObject())
+			return false;
+
+		const rapidjson::Value *frame = &value;
+
+		if (!legacy)
+		{
+			rapidjson::Value::ConstMemberIterator it = value.FindMember("frame");
+
+			if (it == value.MemberEnd() || !it->value.IsObject())
+				return false;
+
+			frame = &it->value;
+		}
+
+		const char *keys[2][4] = {
+			{"x", "y", "w", "h"},
+			{"x", "y", "width", "height"}
+		};
+
+		int *fields[] = {&placement->x, &placement->y, &placement->width, &placement->height};
+
+		for (size_t i = 0; i < countof(fields); i++)
+		{
+			rapidjson::Value::ConstMemberIterator it = frame->FindMember(keys[legacy][i]);
+
+			if (it == frame->MemberEnd() || !it->value.IsInt())
+				return false;
+
+			*fields[i] = it->value.GetInt();
+		}
 
-				results.push_back(result);
+		rapidjson::Value::ConstMemberIterator it = value.FindMember("rotated");
+		placement->rotated = (it != value.MemberEnd() && it->value.IsBool() && it->value.GetBool());
 
-				if (input_indices.size() > 0)
-					calculate_initial_size(input_indices, &w, &h);
+		return true;
+	}
+
+	// Reads the sprite placements from the json file generated by a previous run. Keys of the
+	// placements map are the sprite names as written in that file. Layouts of several pages
+	// aren't supported, so a run that wrote <output>-0.json after <output>.json has none.
+	bool load_previous_layout(std::map<std::string, Placement> &placements, bool *legacy,
+		int *width, int *height)
+	{
+		if (formatting == 3)
+		{
+			fputs("Incremental packing is not supported with the xml format.\n", stderr);
+			return false;
+		}
+
+		std::string filename = std::string(params.output) + ".json";
+		std::string first_page = std::string(params.output) + "-0.json";
+
+		struct stat single;
+		struct stat paged;
+
+		if (stat(first_page.c_str(), &paged) == 0 &&
+			(stat(filename.c_str(), &single) != 0 || paged.st_mtime >= single.st_mtime))
+		{
+			fputs("The previous layout has several pages, packing from scratch.\n", stderr);
+			return false;
+		}
+
+		FILE *file = fopen(filename.c_str(), "rb");
+
+		if (file == 0)
+			return false;
+
+		using namespace rapidjson;
+
+		Document document;
+
+		char buffer[4096];
+		FileReadStream stream(file, buffer, sizeof(buffer));
+		document.ParseStream(stream);
+		fclose(file);
+
+		if (document.HasParseError() || !document.IsObject())
+			return false;
+
+		const Value *sprites = 0;
+		const Value *size = &document;
+
+		*legacy = document.HasMember("sprites");
+
+		if (*legacy)
+		{
+			sprites = &document["sprites"];
+		}
+		else if (document.HasMember("frames") && document.HasMember("meta") &&
+			document["meta"].IsObject() && document["meta"].HasMember("size"))
+		{
+			sprites = &document["frames"];
+			size = &document["meta"]["size"];
+		}
+		else
+		{
+			return false;
+		}
+
+		const char *w = *legacy ? "width" : "w";
+		const char *h = *legacy ? "height" : "h";
+
+		if (!size->IsObject() || !size->HasMember(w) || !size->HasMember(h) ||
+			!(*size)[w].IsInt() || !(*size)[h].IsInt())
+			return false;
+
+		*width = (*size)[w].GetInt();
+		*height = (*size)[h].GetInt();
+
+		Placement placement;
+		placement.position = 0;
+
+		if (sprites->IsObject())
+		{
+			for (Value::ConstMemberIterator it = sprites->MemberBegin(); it != sprites->MemberEnd(); ++it)
+			{
+				if (read_placement(it->value, *legacy, &placement))
+					placements[it->name.GetString()] = placement;
+
+				placement.position++;
 			}
 		}
+		else if (sprites->IsArray())
+		{
+			for (SizeType i = 0; i < sprites->Size(); i++)
+			{
+				const Value &value = (*sprites)[i];
 
-		return results;
+				if (value.IsObject() && value.HasMember("filename") && value["filename"].IsString() &&
+					read_placement(value, *legacy, &placement))
+					placements[value["filename"].GetString()] = placement;
+
+				placement.position++;
+			}
+		}
+
+		return true;
+	}
+
+	// Places the sprites that didn't change at the same coordinates they had in the previous
+	// layout and packs the rest in the remaining space. Returns 0 if they don't fit.
+	Result *compute_incremental_result(const Strategy &strategy,
+		const std::map<std::string, Placement> &previous, bool legacy, int w, int h)
+	{
+		const int mode = strategy.mode;
+
+		int bin_mode;
+		std::unique_ptr<rbp::Bin> bin(create_bin(mode, w - params.padding, h - params.padding, &bin_mode));
+
+		bin->set_ordered(strategy.sort != 0);
+
+		std::vector<rbp::Rect> pinned_rects;
+		std::vector<size_t> pinned_indices;
+		std::vector<size_t> rects_indices;
+
+		std::vector<rbp::Rect> previous_rects(input_sprites.size());
+		std::vector<size_t> positions(input_sprites.size());
+		std::vector<size_t> order;
+
+		for (size_t i = 0; i < input_sprites.size(); i++)
+		{
+			const Sprite &sprite = input_sprites[i];
+
+			std::map<std::string, Placement>::const_iterator it = previous.find(legacy ?
+				std::string(sprite.filename) : remove_extension(sprite.filename));
+
+			if (it != previous.end())
+			{
+				const Placement &placement = it->second;
+
+				bool same_size = placement.rotated ?
+					(params.rotate && placement.width == sprite.height && placement.height == sprite.width) :
+					(placement.width == sprite.width && placement.height == sprite.height);
+
+				rbp::Rect &rect = previous_rects[i];
+
+				rect.x = placement.x - params.padding;
+				rect.y = placement.y - params.padding;
+				rect.width = placement.width + params.padding;
+				rect.height = placement.height + params.padding;
+
+				positions[i] = placement.position;
+
+				if (same_size && rect.x >= 0 && rect.y >= 0)
+					order.push_back(i);
+			}
+		}
+
+		// a skyline only grows, so its rects have to be put back from the top down
+		if (mode == SkylineBottomLeft || mode == SkylineMinWaste)
+		{
+			std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+				return previous_rects[a].y < previous_rects[b].y;
+			});
+		}
+
+		std::vector<bool> pinned(input_sprites.size(), false);
+
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			if (bin->occupy(previous_rects[order[i]]))
+			{
+				pinned_indices.push_back(order[i]);
+				pinned[order[i]] = true;
+			}
+		}
+
+		// the sprites that stay come first and in the order they had, so the layout of an
+		// unchanged input is written out the same as before
+		std::stable_sort(pinned_indices.begin(), pinned_indices.end(), [&](size_t a, size_t b) {
+			return positions[a] < positions[b];
+		});
+
+		for (size_t i = 0; i < pinned_indices.size(); i++)
+			pinned_rects.push_back(previous_rects[pinned_indices[i]]);
+
+		for (size_t i = 0; i < input_sprites.size(); i++)
+		{
+			if (!pinned[i])
+				rects_indices.push_back(i);
+		}
+
+		if (strategy.sort != 0)
+			sort_indices(strategy.sort, rects_indices);
+
+		std::vector<rbp::Rect> result_rects;
+		std::vector<size_t> result_indices;
+
+		bin->insert(bin_mode, input_rects, rects_indices, result_rects, result_indices);
+
+		if (rects_indices.size() > 0)
+			return 0;
+
+		pinned_rects.insert(pinned_rects.end(), result_rects.begin(), result_rects.end());
+		pinned_indices.insert(pinned_indices.end(), result_indices.begin(), result_indices.end());
+
+		return create_result(w, h, pinned_rects, pinned_indices, false);
+	}
+
+	bool compute_incremental_results(int mode, std::vector<Result*> &results)
+	{
+		std::map<std::string, Placement> previous;
+		bool legacy;
+		int w;
+		int h;
+
+		if (!load_previous_layout(previous, &legacy, &w, &h))
+			return false;
+
+		if (w <= params.padding || h <= params.padding ||
+			(has_fixed_size() && (w != params.width || h != params.height)) ||
+			(params.max_size && (w > params.width || h > params.height)))
+			return false;
+
+		// the atlas size is fixed, so there's nothing for a search budget to improve and the first
+		// heuristic that fits everything is used
+		std::vector<Strategy> strategies = list_strategies(mode, sort_mode(params.sort), false);
+		std::vector<Result*> candidates(strategies.size());
+
+		pool.run(strategies.size(), [&](size_t i) {
+			candidates[i] = compute_incremental_result(strategies[i], previous, legacy, w, h);
+		});
+
+		for (size_t i = 0; i < candidates.size(); i++)
+		{
+			if (candidates[i] != 0 && results.empty())
+				results.push_back(candidates[i]);
+			else
+				delete candidates[i];
+		}
+
+		if (results.empty())
+			fputs("Sprites don't fit in the previous layout, packing from scratch.\n", stderr);
+
+		return !results.empty();
 	}
 
 	void load_metadata()
@@ -679,154 +1719,284 @@ struct Packer
 		}
 	}
 
+	// Pages are written in parallel. Those that keep the whole atlas in memory for bleeding wait
+	// until their buffer fits in page_memory along with the ones already being written.
 	void create_png_files(const std::vector<Result*> &results)
 	{
 		char buf[32];
-		std::string filename;
+		std::vector<std::string> filenames(results.size());
 
 		for (size_t i = 0; i < results.size(); i++)
 		{
-			filename = params.output;
+			filenames[i] = params.output;
 
 			if (results.size() > 1)
 			{
 				sprintf(buf, "-%d.png", (int)i);
-				filename += buf;
+				filenames[i] += buf;
 			}
 			else
 			{
-				filename += ".png";
+				filenames[i] += ".png";
 			}
-
-			create_png_file(filename.c_str(), *results[i]);
 		}
+
+		std::mutex mutex;
+		std::condition_variable released;
+		size_t used = 0;
+
+		pool.run(results.size(), [&](size_t i)
+		{
+			const size_t memory = bleeding() ? (size_t)results[i]->width * results[i]->height * 4 : 0;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				released.wait(lock, [&]() { return used == 0 || used + memory <= page_memory; });
+				used += memory;
+			}
+
+			create_png_file(filenames[i].c_str(), *results[i]);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				used -= memory;
+			}
+
+			released.notify_all();
+		});
 	}
 
-	uint8_t *load_sprite(const Sprite &sprite, int *channels)
+	// Returns the decoded image of the sprite, either from the store or from its file. pixels
+	// points to the top-left of the trimmed area and rows are pitch bytes apart.
+	uint8_t *load_sprite(const Sprite &sprite, int *channels, int *pitch, const uint8_t **pixels)
 	{
+		uint8_t *data = store.take(sprite.index, channels);
+
+		if (data != 0)
+		{
+			*pitch = sprite.width * (*channels);
+			*pixels = data;
+			return data;
+		}
+
 		int width;
 		int height;
 
-		uint8_t *data = png::load(sprite.filename, &width, &height, channels);
+		data = png::load(sprite.filename, &width, &height, channels);
 
 		if (data == 0 || width != sprite.real_width || height != sprite.real_height || *channels < 3)
 		{
 			fprintf(stderr, "Something is wrong with the image %s\n", sprite.filename);
 
 			delete[] data;
-			data = 0;
+			return 0;
 		}
 
+		*pitch = width * (*channels);
+		*pixels = data + sprite.yoffset * (*pitch) + sprite.xoffset * (*channels);
+
 		return data;
 	}
 
-	void create_png_file(const char *filename, const Result &result)
+	// Bleeds every sprite into the padding around it. Each sprite gets its packed rect (sprite
+	// plus padding) moved back by half the padding, so these areas don't overlap and can be
+	// processed in parallel.
+	void bleed_sprites(uint8_t *image, const Result &result)
 	{
-		std::vector<uint8_t> dstbuffer(4 * result.width * result.height);
-		std::vector<uint8_t> srcbuffer;
-
-		const int w = result.width;
-		const int h = result.height;
-		const int dstpitch = w * 4;
+		const int pitch = result.width * 4;
+		const int margin = params.padding / 2;
 
-		for (size_t i = 0; i < result.sprites.size(); i++)
+		pool.run(result.sprites.size(), [&](size_t i)
 		{
 			const Sprite &sprite = result.sprites[i];
 
-			int channels;
-			const uint8_t *data = load_sprite(sprite, &channels);
+			const int w = sprite.rotated ? sprite.height : sprite.width;
+			const int h = sprite.rotated ? sprite.width : sprite.height;
 
-			if (data == 0)
-			{
-				channels = 4;
-				srcbuffer.resize(channels * sprite.real_width * sprite.real_height);
-				data = &srcbuffer[0];
-			}
+			const int x0 = std::max(sprite.x - margin, 0);
+			const int y0 = std::max(sprite.y - margin, 0);
+			const int x1 = std::min(sprite.x - margin + w + params.padding, result.width);
+			const int y1 = std::min(sprite.y - margin + h + params.padding, result.height);
 
-			const int x0 = sprite.xoffset;
-			const int y0 = sprite.yoffset;
-			const int srcpitch = sprite.real_width * channels;
-			const uint8_t *src = &data[y0 * srcpitch + x0 * channels];
+			bleed_apply(image + y0 * pitch + x0 * 4, x1 - x0, y1 - y0, pitch);
+		});
+	}
 
-			if (sprite.rotated)
-			{
-				// top-left of the sprite will be at top-right in the spritesheet
+	// Copies the rows of a sprite that fall in [y0, y1) to band, which holds the atlas rows from y0.
+	// With --premultiplied, each row is premultiplied right after it's copied, while it's still in
+	// cache. RGB sprites are opaque and don't need it.
+	void blit_sprite(const DecodedSprite &decoded, int y0, int y1, uint8_t *band, int dstpitch)
+	{
+		const Sprite &sprite = *decoded.sprite;
+		const int channels = decoded.channels;
+		const int srcpitch = decoded.pitch;
 
-				uint8_t *dst = &dstbuffer[4 * (sprite.y * w + sprite.x + sprite.height - 1)];
+		const bool premultiply = params.premultiplied && channels == 4;
+		const int first = std::max(y0, sprite.y);
 
-				const int nextcol = -(sprite.width * dstpitch + 4);
+		if (sprite.rotated)
+		{
+			// top-left of the sprite will be at top-right in the spritesheet, so each row of the
+			// atlas is a column of the sprite
 
-				for (int y = 0; y < sprite.height; y++)
-				{
-					const uint8_t *s = src;
+			const int end = std::min(y1, sprite.y + sprite.width);
 
-					for (int x = 0; x < sprite.width; x++)
-					{
-						dst[0] = *s++;
-						dst[1] = *s++;
-						dst[2] = *s++;
-						dst[3] = channels == 4 ? *s++ : 0xFF;
+			// a few rows at a time, which are the tiles of rotate_pixels()
+			for (int y = first; y < end; y += 8)
+			{
+				const int count = std::min(8, end - y);
+				uint8_t *dst = band + (y - y0) * dstpitch + 4 * sprite.x;
 
-						dst += dstpitch;
-					}
+				rotate_pixels(decoded.pixels + (y - sprite.y) * channels, srcpitch, channels, count, sprite.height,
+					dst, dstpitch);
 
-					src += srcpitch;
-					dst += nextcol;
-				}
+				for (int i = 0; premultiply && i < count; i++)
+					premultiply_pixels(dst + i * dstpitch, sprite.height);
 			}
-			else
-			{
-				const int row_size = channels * sprite.width;
-				uint8_t *dst = &dstbuffer[4 * (sprite.y * w + sprite.x)];
+		}
+		else
+		{
+			const int end = std::min(y1, sprite.y + sprite.height);
+			const int row_size = channels * sprite.width;
+
+			const uint8_t *src = decoded.pixels + (first - sprite.y) * srcpitch;
+			uint8_t *dst = band + (first - y0) * dstpitch + 4 * sprite.x;
 
-				if (channels == 4)
+			if (channels == 4)
+			{
+				for (int y = first; y < end; y++)
 				{
-					for (int y = 0; y < sprite.height; y++)
-					{
-						memcpy(dst, src, row_size);
+					memcpy(dst, src, row_size);
 
-						src += srcpitch;
-						dst += dstpitch;
-					}
+					if (premultiply)
+						premultiply_pixels(dst, sprite.width);
+
+					src += srcpitch;
+					dst += dstpitch;
 				}
-				else if (channels == 3)
+			}
+			else if (channels == 3)
+			{
+				for (int y = first; y < end; y++)
 				{
-					for (int y = 0; y < sprite.height; y++)
-					{
-						for (int xs = 0, xd = 0; xs < row_size; xs += 3, xd += 4)
-						{
-							dst[xd + 0] = src[xs + 0];
-							dst[xd + 1] = src[xs + 1];
-							dst[xd + 2] = src[xs + 2];
-							dst[xd + 3] = 0xFF;
-						}
+					expand_rgb(src, dst, sprite.width);
 
-						src += srcpitch;
-						dst += dstpitch;
-					}
+					src += srcpitch;
+					dst += dstpitch;
 				}
 			}
+		}
+	}
+
+	// Bleeding only sets the color of transparent pixels, which premultiplying turns black again.
+	bool bleeding() const
+	{
+		return (params.bleed || params.sprite_bleed) && !params.premultiplied;
+	}
 
-			if (data != &srcbuffer[0])
-				delete[] data;
+	// The atlas is put together and written one band of rows at a time. Sprites are decoded
+	// when the first band they're in comes up and freed after the last one, so only the band
+	// and the sprites crossing it are in memory. Bleeding reads across sprites, so it gets a
+	// single band with the whole atlas.
+	void create_png_file(const char *filename, const Result &result)
+	{
+		const int w = result.width;
+		const int h = result.height;
+		const int dstpitch = w * 4;
+
+		static const int levels[] = { 1, 6, 9 };
+		static const png::Filter filters[] = { png::FilterSub, png::FilterAdaptive, png::FilterSearch };
+
+		int speed = png_speed_mode(params.png_speed);
+		int level = params.compression >= 0 ? params.compression : levels[speed];
+
+		png::Writer writer;
+
+		if (!writer.open(filename, w, h, level, filters[speed], &pool))
+		{
+			fprintf(stderr, "Error writing %s\n", filename);
+			return;
 		}
 
-		if (params.bleed)
-			bleed_apply(&dstbuffer[0], w, h);
+		const int band_rows = bleeding() ? h : std::max(1, (int)(band_bytes / dstpitch));
+
+		std::vector<uint8_t> band((size_t)band_rows * dstpitch);
+
+		// sprites by their top row
+		std::vector<const Sprite*> order(result.sprites.size());
 
-		if (params.premultiplied)
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = &result.sprites[i];
+
+		std::stable_sort(order.begin(), order.end(), [](const Sprite *a, const Sprite *b) {
+			return a->y < b->y;
+		});
+
+		std::vector<DecodedSprite> active;
+		size_t next = 0;
+
+		for (int y0 = 0; y0 < h; y0 += band_rows)
 		{
-			for (uint8_t *p = &dstbuffer[0]; p < &dstbuffer.back(); p++)
+			const int y1 = std::min(h, y0 + band_rows);
+			const size_t band_size = (size_t)(y1 - y0) * dstpitch;
+
+			memset(&band[0], 0, band_size);
+
+			const size_t first_new = active.size();
+
+			for (; next < order.size() && order[next]->y < y1; next++)
+			{
+				DecodedSprite decoded;
+
+				decoded.sprite = order[next];
+				decoded.data = 0;
+
+				active.push_back(decoded);
+			}
+
+			// the sprites' rects don't overlap, so they're decoded and copied in parallel
+			pool.run(active.size(), [&](size_t i)
+			{
+				DecodedSprite &decoded = active[i];
+
+				if (i >= first_new)
+					decoded.data = load_sprite(*decoded.sprite, &decoded.channels, &decoded.pitch, &decoded.pixels);
+
+				if (decoded.data != 0)
+					blit_sprite(decoded, y0, y1, &band[0], dstpitch);
+			});
+
+			for (size_t i = 0; i < active.size(); )
 			{
-				float alpha = p[3] / 255.f;
+				const DecodedSprite &decoded = active[i];
+				const Sprite &sprite = *decoded.sprite;
+
+				if (sprite.y + (sprite.rotated ? sprite.width : sprite.height) <= y1)
+				{
+					delete[] decoded.data;
 
-				*p++ *= alpha;
-				*p++ *= alpha;
-				*p++ *= alpha;
+					active[i] = active.back();
+					active.pop_back();
+				}
+				else
+				{
+					i++;
+				}
+			}
+
+			if (bleeding())
+			{
+				if (params.sprite_bleed)
+					bleed_sprites(&band[0], result);
+				else
+					bleed_apply(&band[0], w, h, dstpitch, &pool);
 			}
+
+			writer.write_rows(&band[0], y1 - y0);
 		}
 
-		png::save(filename, w, h, &dstbuffer[0]);
+		if (!writer.close())
+			fprintf(stderr, "Error writing %s\n", filename);
 	}
 
 	void create_files(const std::vector<Result*> &results)
@@ -8,36 +8,54 @@ namespace pkr
 		Params():
 			output(0),
 			metadata(0),
+			cache(0),
 			mode("auto"),
+			sort("auto"),
 			format("legacy"),
 			bleed(false),
+			sprite_bleed(false),
 			premultiplied(false),
 			pot(false),
 			rotate(false),
 			pretty(false),
 			trim(false),
+			incremental(false),
 			indentation(0),
 			padding(0),
 			width(0),
 			height(0),
-			max_size(false)
+			max_size(false),
+			jobs(0),
+			keep_decoded(0),
+			compression(-1),
+			png_speed("default"),
+			search_budget(0)
 		{}
 
 		const char *output;
 		const char *metadata;
+		const char *cache;
 		const char *mode;
+		const char *sort;
 		const char *format;
 		bool bleed;
+		bool sprite_bleed;
 		bool premultiplied;
 		bool pot;
 		bool rotate;
 		bool pretty;
 		bool trim;
+		bool incremental;
 		int indentation;
 		int padding;
 		int width;
 		int height;
 		bool max_size;
+		int jobs;
+		int keep_decoded;
+		int compression;
+		const char *png_speed;
+		int search_budget;
 	};
 
 	int pack(std::istream &input, const Params &params);
@@ -0,0 +1,661 @@
+#include "pixels.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+	#include <immintrin.h>
+
+	#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		#define PIXELS_SSE2
+	#endif
+
+	#if defined(_MSC_VER)
+		#include <intrin.h>
+		#define PIXELS_SSSE3
+		#define PIXELS_AVX2
+		#define TARGET_SSSE3
+		#define TARGET_AVX2
+	#elif defined(__GNUC__)
+		#define PIXELS_SSSE3
+		#define PIXELS_AVX2
+		#define TARGET_SSSE3 __attribute__((target("ssse3")))
+		#define TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+	#include <arm_neon.h>
+	#define PIXELS_NEON
+#endif
+
+// rotate_tiles() has to be inlined into the kernels so their tiles can be inlined as well,
+// which doesn't happen on its own for the ones built for a different target.
+#if defined(_MSC_VER)
+	#define ALWAYS_INLINE __forceinline
+#else
+	#define ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
+
+// Each kernel gets a row of count RGBA pixels. find_first returns the index of the first pixel
+// with non-zero alpha or count if there is none, find_last the index of the last one or -1.
+typedef int (*FindFunc)(const uint8_t *row, int count);
+
+// Same arguments as rotate_pixels(), expand_rgb() and premultiply_pixels().
+typedef void (*RotateFunc)(const uint8_t *src, int srcpitch, int channels, int width, int height, uint8_t *dst,
+	int dstpitch);
+typedef void (*ExpandFunc)(const uint8_t *src, uint8_t *dst, int count);
+typedef void (*PremultiplyFunc)(uint8_t *pixels, int count);
+
+struct Kernels
+{
+	FindFunc find_first;
+	FindFunc find_last;
+	RotateFunc rotate;
+	ExpandFunc expand;
+	PremultiplyFunc premultiply;
+};
+
+static int first_scalar(const uint8_t *row, int count)
+{
+	for (int x = 0; x < count; x++)
+	{
+		if (row[x * 4 + 3] != 0)
+			return x;
+	}
+
+	return count;
+}
+
+static int last_scalar(const uint8_t *row, int count)
+{
+	for (int x = count - 1; x >= 0; x--)
+	{
+		if (row[x * 4 + 3] != 0)
+			return x;
+	}
+
+	return -1;
+}
+
+// Rotates the pixels in columns [x0, x1) and rows [y0, y1) of the source. height is the height
+// of the whole source, which is the width of dst.
+static void rotate_rect(const uint8_t *src, int srcpitch, int channels, int x0, int x1, int y0, int y1, int height,
+	uint8_t *dst, int dstpitch)
+{
+	for (int x = x0; x < x1; x++)
+	{
+		const uint8_t *s = src + y0 * srcpitch + x * channels;
+		uint8_t *d = dst + x * dstpitch + (height - 1 - y0) * 4;
+
+		for (int y = y0; y < y1; y++)
+		{
+			d[0] = s[0];
+			d[1] = s[1];
+			d[2] = s[2];
+			d[3] = channels == 4 ? s[3] : 0xFF;
+
+			s += srcpitch;
+			d -= 4;
+		}
+	}
+}
+
+// Goes through the source in square tiles, so the rows read and written by a tile stay in
+// cache. Tiles of the vector kernels are transposed in registers, anything left over is done
+// by rotate_rect.
+typedef void (*TileFunc)(const uint8_t *src, int srcpitch, uint8_t *dst, int dstpitch);
+
+template <int Size, TileFunc Tile>
+static ALWAYS_INLINE void rotate_tiles(const uint8_t *src, int srcpitch, int channels, int width, int height, uint8_t *dst,
+	int dstpitch)
+{
+	const int full_width = width - width % Size;
+	const int full_height = height - height % Size;
+
+	for (int x = 0; x < full_width; x += Size)
+	{
+		for (int y = 0; y < full_height; y += Size)
+			Tile(src + y * srcpitch + x * channels, srcpitch, dst + x * dstpitch + (height - y - Size) * 4, dstpitch);
+
+		rotate_rect(src, srcpitch, channels, x, x + Size, full_height, height, height, dst, dstpitch);
+	}
+
+	rotate_rect(src, srcpitch, channels, full_width, width, 0, height, height, dst, dstpitch);
+}
+
+static void rotate_scalar(const uint8_t *src, int srcpitch, int channels, int width, int height, uint8_t *dst,
+	int dstpitch)
+{
+	const int size = 8;
+
+	for (int x = 0; x < width; x += size)
+	{
+		for (int y = 0; y < height; y += size)
+		{
+			rotate_rect(src, srcpitch, channels, x, x + size < width ? x + size : width, y,
+				y + size < height ? y + size : height, height, dst, dstpitch);
+		}
+	}
+}
+
+static void expand_scalar(const uint8_t *src, uint8_t *dst, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		dst[0] = src[0];
+		dst[1] = src[1];
+		dst[2] = src[2];
+		dst[3] = 0xFF;
+
+		src += 3;
+		dst += 4;
+	}
+}
+
+// c * a / 255 rounded to nearest, which is the same as (c * a + 127) / 255
+static inline uint8_t mul_alpha(unsigned c, unsigned a)
+{
+	unsigned t = c * a + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+static void premultiply_scalar(uint8_t *pixels, int count)
+{
+	for (int i = 0; i < count; i++, pixels += 4)
+	{
+		const unsigned a = pixels[3];
+
+		pixels[0] = mul_alpha(pixels[0], a);
+		pixels[1] = mul_alpha(pixels[1], a);
+		pixels[2] = mul_alpha(pixels[2], a);
+	}
+}
+
+// The vector kernels skip whole blocks of transparent pixels and leave the block that has
+// the pixel, or the leftover pixels at the end of the row, to the scalar ones.
+
+#ifdef PIXELS_SSE2
+static inline bool any_alpha_sse2(const uint8_t *p) // 16 pixels
+{
+	const __m128i mask = _mm_set1_epi32((int)0xff000000);
+
+	__m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)p), _mm_loadu_si128((const __m128i *)(p + 16)));
+	__m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)), _mm_loadu_si128((const __m128i *)(p + 48)));
+	__m128i v = _mm_and_si128(_mm_or_si128(a, b), mask);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff;
+}
+
+static int first_sse2(const uint8_t *row, int count)
+{
+	int x = 0;
+
+	while (x + 16 <= count && !any_alpha_sse2(row + x * 4))
+		x += 16;
+
+	return x + first_scalar(row + x * 4, count - x);
+}
+
+static int last_sse2(const uint8_t *row, int count)
+{
+	int x = count;
+
+	while (x >= 16 && !any_alpha_sse2(row + (x - 16) * 4))
+		x -= 16;
+
+	return last_scalar(row, x);
+}
+
+// Transposes 4x4 RGBA pixels. Source rows are loaded bottom to top, so each column comes out
+// as a rotated row.
+static inline void tile_sse2(const uint8_t *src, int srcpitch, uint8_t *dst, int dstpitch)
+{
+	__m128i r0 = _mm_loadu_si128((const __m128i *)(src + 3 * srcpitch));
+	__m128i r1 = _mm_loadu_si128((const __m128i *)(src + 2 * srcpitch));
+	__m128i r2 = _mm_loadu_si128((const __m128i *)(src + srcpitch));
+	__m128i r3 = _mm_loadu_si128((const __m128i *)src);
+
+	__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+	__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+	__m128i t2 = _mm_unpackhi_epi32(r0, r1);
+	__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)(dst + dstpitch), _mm_unpackhi_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)(dst + 2 * dstpitch), _mm_unpacklo_epi64(t2, t3));
+	_mm_storeu_si128((__m128i *)(dst + 3 * dstpitch), _mm_unpackhi_epi64(t2, t3));
+}
+
+static void rotate_sse2(const uint8_t *src, int srcpitch, int channels, int width, int height, uint8_t *dst,
+	int dstpitch)
+{
+	// RGB needs a byte shuffle to expand, which SSE2 doesn't have
+	if (channels == 4)
+		rotate_tiles<4, tile_sse2>(src, srcpitch, channels, width, height, dst, dstpitch);
+	else
+		rotate_scalar(src, srcpitch, channels, width, height, dst, dstpitch);
+}
+
+// Like mul_alpha() for 16-bit lanes.
+static inline __m128i mul_alpha_sse2(__m128i c, __m128i a)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(c, a), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// Widens 2 pixels to 16-bit lanes and multiplies them by their alpha, which is multiplied by 255
+// so it stays the same.
+static inline __m128i premultiply2_sse2(__m128i v)
+{
+	const __m128i keep_alpha = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+
+	__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	return mul_alpha_sse2(v, _mm_or_si128(a, keep_alpha));
+}
+
+static void premultiply_sse2(uint8_t *pixels, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	int i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(pixels + i * 4));
+
+		__m128i lo = premultiply2_sse2(_mm_unpacklo_epi8(v, zero));
+		__m128i hi = premultiply2_sse2(_mm_unpackhi_epi8(v, zero));
+
+		_mm_storeu_si128((__m128i *)(pixels + i * 4), _mm_packus_epi16(lo, hi));
+	}
+
+	premultiply_scalar(pixels + i * 4, count - i);
+}
+#endif
+
+#ifdef PIXELS_SSSE3
+// Spreads 4 RGB pixels from the first 12 bytes to RGBA with zero alpha.
+TARGET_SSSE3 static inline __m128i spread_rgb_ssse3(__m128i v)
+{
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	return _mm_shuffle_epi8(v, shuffle);
+}
+
+TARGET_SSSE3 static void expand_ssse3(const uint8_t *src, uint8_t *dst, int count)
+{
+	const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+	int i = 0;
+
+	// each load reads 4 bytes past the pixels it expands
+	for (; i + 6 <= count; i += 4)
+	{
+		__m128i v = spread_rgb_ssse3(_mm_loadu_si128((const __m128i *)(src + i * 3)));
+		_mm_storeu_si128((__m128i *)(dst + i * 4), _mm_or_si128(v, alpha));
+	}
+
+	expand_scalar(src + i * 3, dst + i * 4, count - i);
+}
+
+static bool cpu_has_ssse3()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+
+	return (info[2] & (1 << 9)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+#endif
+}
+#endif
+
+#ifdef PIXELS_AVX2
+TARGET_AVX2 static inline bool any_alpha_avx2(const uint8_t *p) // 32 pixels
+{
+	const __m256i mask = _mm256_set1_epi32((int)0xff000000);
+
+	__m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)p), _mm256_loadu_si256((const __m256i *)(p + 32)));
+	__m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + 64)), _mm256_loadu_si256((const __m256i *)(p + 96)));
+
+	return !_mm256_testz_si256(_mm256_or_si256(a, b), mask);
+}
+
+TARGET_AVX2 static int first_avx2(const uint8_t *row, int count)
+{
+	int x = 0;
+
+	while (x + 32 <= count && !any_alpha_avx2(row + x * 4))
+		x += 32;
+
+	return x + first_scalar(row + x * 4, count - x);
+}
+
+TARGET_AVX2 static int last_avx2(const uint8_t *row, int count)
+{
+	int x = count;
+
+	while (x >= 32 && !any_alpha_avx2(row + (x - 32) * 4))
+		x -= 32;
+
+	return last_scalar(row, x);
+}
+
+TARGET_AVX2 static inline __m128i expand_rgb_avx2(const uint8_t *p) // 4 pixels
+{
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+	int last;
+	memcpy(&last, p + 8, 4);
+
+	__m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p), _mm_cvtsi32_si128(last));
+
+	return _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha);
+}
+
+// 8 RGB pixels expanded to RGBA
+TARGET_AVX2 static inline __m256i load_rgb_avx2(const uint8_t *p)
+{
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(expand_rgb_avx2(p)), expand_rgb_avx2(p + 12), 1);
+}
+
+// Transposes 8x8 pixels, with source rows loaded bottom to top like tile_sse2.
+template <__m256i (*Load)(const uint8_t *)>
+TARGET_AVX2 static inline void tile_avx2(const uint8_t *src, int srcpitch, uint8_t *dst, int dstpitch)
+{
+	__m256i r[8];
+
+	for (int i = 0; i < 8; i++)
+		r[i] = Load(src + (7 - i) * srcpitch);
+
+	__m256i t[8];
+
+	for (int i = 0; i < 8; i += 2)
+	{
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+
+	__m256i u[8];
+
+	for (int i = 0; i < 8; i += 4)
+	{
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		_mm256_storeu_si256((__m256i *)(dst + i * dstpitch), _mm256_permute2x128_si256(u[i], u[i + 4], 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + (i + 4) * dstpitch), _mm256_permute2x128_si256(u[i], u[i + 4], 0x31));
+	}
+}
+
+// Only for RGB. The 8x8 tiles are slower than the 4x4 ones of SSE2 for RGBA, which doesn't need
+// the expanding shuffle.
+TARGET_AVX2 static void rotate_avx2(const uint8_t *src, int srcpitch, int channels, int width, int height,
+	uint8_t *dst, int dstpitch)
+{
+	if (channels == 4)
+		rotate_sse2(src, srcpitch, channels, width, height, dst, dstpitch);
+	else
+		rotate_tiles<8, tile_avx2<load_rgb_avx2> >(src, srcpitch, channels, width, height, dst, dstpitch);
+}
+
+TARGET_AVX2 static void expand_avx2(const uint8_t *src, uint8_t *dst, int count)
+{
+	const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+
+	int i = 0;
+
+	// 4 pixels per lane, the load for the second lane reads 4 bytes past the pixels
+	for (; i + 10 <= count; i += 8)
+	{
+		__m128i lo = _mm_loadu_si128((const __m128i *)(src + i * 3));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(src + i * 3 + 12));
+
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		_mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha));
+	}
+
+	expand_scalar(src + i * 3, dst + i * 4, count - i);
+}
+
+TARGET_AVX2 static inline __m256i premultiply4_avx2(__m256i v) // like premultiply2_sse2()
+{
+	const __m256i keep_alpha = _mm256_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255);
+
+	__m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(v, _mm256_or_si256(a, keep_alpha)), _mm256_set1_epi16(128));
+
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+TARGET_AVX2 static void premultiply_avx2(uint8_t *pixels, int count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	int i = 0;
+
+	// unpacking and packing both work within 128-bit lanes, so the pixels stay in order
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(pixels + i * 4));
+
+		__m256i lo = premultiply4_avx2(_mm256_unpacklo_epi8(v, zero));
+		__m256i hi = premultiply4_avx2(_mm256_unpackhi_epi8(v, zero));
+
+		_mm256_storeu_si256((__m256i *)(pixels + i * 4), _mm256_packus_epi16(lo, hi));
+	}
+
+	premultiply_scalar(pixels + i * 4, count - i);
+}
+
+static bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 0);
+
+	if (info[0] < 7)
+		return false;
+
+	// the OS has to save the YMM registers too
+	__cpuid(info, 1);
+
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifdef PIXELS_NEON
+static inline bool any_alpha_neon(const uint8_t *p) // 16 pixels
+{
+	uint8x16x4_t v = vld4q_u8(p);
+	return vmaxvq_u8(v.val[3]) != 0;
+}
+
+static int first_neon(const uint8_t *row, int count)
+{
+	int x = 0;
+
+	while (x + 16 <= count && !any_alpha_neon(row + x * 4))
+		x += 16;
+
+	return x + first_scalar(row + x * 4, count - x);
+}
+
+static int last_neon(const uint8_t *row, int count)
+{
+	int x = count;
+
+	while (x >= 16 && !any_alpha_neon(row + (x - 16) * 4))
+		x -= 16;
+
+	return last_scalar(row, x);
+}
+
+// Transposes 4x4 RGBA pixels, with source rows loaded bottom to top like tile_sse2.
+static inline void tile_neon(const uint8_t *src, int srcpitch, uint8_t *dst, int dstpitch)
+{
+	uint32x4_t r0 = vreinterpretq_u32_u8(vld1q_u8(src + 3 * srcpitch));
+	uint32x4_t r1 = vreinterpretq_u32_u8(vld1q_u8(src + 2 * srcpitch));
+	uint32x4_t r2 = vreinterpretq_u32_u8(vld1q_u8(src + srcpitch));
+	uint32x4_t r3 = vreinterpretq_u32_u8(vld1q_u8(src));
+
+	uint32x4x2_t t01 = vtrnq_u32(r0, r1);
+	uint32x4x2_t t23 = vtrnq_u32(r2, r3);
+
+	vst1q_u8(dst, vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0]))));
+	vst1q_u8(dst + dstpitch, vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1]))));
+	vst1q_u8(dst + 2 * dstpitch, vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0]))));
+	vst1q_u8(dst + 3 * dstpitch, vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1]))));
+}
+
+static void rotate_neon(const uint8_t *src, int srcpitch, int channels, int width, int height, uint8_t *dst,
+	int dstpitch)
+{
+	if (channels == 4)
+		rotate_tiles<4, tile_neon>(src, srcpitch, channels, width, height, dst, dstpitch);
+	else
+		rotate_scalar(src, srcpitch, channels, width, height, dst, dstpitch);
+}
+
+static void expand_neon(const uint8_t *src, uint8_t *dst, int count)
+{
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		uint8x16x3_t rgb = vld3q_u8(src + i * 3);
+		uint8x16x4_t rgba = { { rgb.val[0], rgb.val[1], rgb.val[2], vdupq_n_u8(0xFF) } };
+
+		vst4q_u8(dst + i * 4, rgba);
+	}
+
+	expand_scalar(src + i * 3, dst + i * 4, count - i);
+}
+
+// Like mul_alpha(): (p + ((p + 128) >> 8) + 128) >> 8
+static inline uint8x16_t mul_alpha_neon(uint8x16_t c, uint8x16_t a)
+{
+	uint16x8_t lo = vmull_u8(vget_low_u8(c), vget_low_u8(a));
+	uint16x8_t hi = vmull_u8(vget_high_u8(c), vget_high_u8(a));
+
+	return vcombine_u8(vrshrn_n_u16(vrsraq_n_u16(lo, lo, 8), 8), vrshrn_n_u16(vrsraq_n_u16(hi, hi, 8), 8));
+}
+
+static void premultiply_neon(uint8_t *pixels, int count)
+{
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		uint8x16x4_t v = vld4q_u8(pixels + i * 4);
+
+		v.val[0] = mul_alpha_neon(v.val[0], v.val[3]);
+		v.val[1] = mul_alpha_neon(v.val[1], v.val[3]);
+		v.val[2] = mul_alpha_neon(v.val[2], v.val[3]);
+
+		vst4q_u8(pixels + i * 4, v);
+	}
+
+	premultiply_scalar(pixels + i * 4, count - i);
+}
+#endif
+
+static Kernels select_kernels()
+{
+	Kernels kernels = { first_scalar, last_scalar, rotate_scalar, expand_scalar, premultiply_scalar };
+
+#ifdef PIXELS_SSE2
+	kernels.find_first = first_sse2;
+	kernels.find_last = last_sse2;
+	kernels.rotate = rotate_sse2;
+	kernels.premultiply = premultiply_sse2;
+#endif
+
+#ifdef PIXELS_SSSE3
+	if (cpu_has_ssse3())
+		kernels.expand = expand_ssse3;
+#endif
+
+#ifdef PIXELS_AVX2
+	if (cpu_has_avx2())
+	{
+		kernels.find_first = first_avx2;
+		kernels.find_last = last_avx2;
+		kernels.rotate = rotate_avx2;
+		kernels.expand = expand_avx2;
+		kernels.premultiply = premultiply_avx2;
+	}
+#endif
+
+#ifdef PIXELS_NEON
+	kernels.find_first = first_neon;
+	kernels.find_last = last_neon;
+	kernels.rotate = rotate_neon;
+	kernels.expand = expand_neon;
+	kernels.premultiply = premultiply_neon;
+#endif
+
+	return kernels;
+}
+
+static const Kernels kernels = select_kernels();
+
+void AlphaBounds::add_row(const uint8_t *row, int y, int width)
+{
+	const int first = kernels.find_first(row, width);
+
+	if (first == width)
+		return;
+
+	if (empty())
+	{
+		top = y;
+		left = first;
+		right = first + kernels.find_last(row + first * 4, width - first);
+	}
+	else
+	{
+		if (first < left)
+			left = first;
+
+		// only pixels right of the current bounds can move them
+		const int from = first > right ? first : right + 1;
+		const int last = kernels.find_last(row + from * 4, width - from);
+
+		if (last >= 0)
+			right = from + last;
+	}
+
+	bottom = y;
+}
+
+void rotate_pixels(const uint8_t *src, int srcpitch, int channels, int width, int height, uint8_t *dst, int dstpitch)
+{
+	kernels.rotate(src, srcpitch, channels, width, height, dst, dstpitch);
+}
+
+void expand_rgb(const uint8_t *src, uint8_t *dst, int count)
+{
+	kernels.expand(src, dst, count);
+}
+
+void premultiply_pixels(uint8_t *pixels, int count)
+{
+	kernels.premultiply(pixels, count);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+// Bounds of the pixels with non-zero alpha in an RGBA image, built one row at a time with
+// SIMD kernels picked for the running CPU.
+struct AlphaBounds
+{
+	AlphaBounds() : left(0), top(0), right(-1), bottom(-1) {}
+
+	int left;
+	int top;
+	int right;
+	int bottom;
+
+	bool empty() const { return bottom < 0; }
+
+	// Rows must be added in order, y is the row's position in the image.
+	void add_row(const uint8_t *row, int y, int width);
+};
+
+// Copies a width x height block of pixels rotated 90 degrees clockwise, so column x of the
+// source becomes row x of dst with the bottom row of the source on the left. The source has
+// channels 3 (RGB) or 4 (RGBA), dst is RGBA with alpha 255 for RGB sources.
+void rotate_pixels(const uint8_t *src, int srcpitch, int channels, int width, int height, uint8_t *dst, int dstpitch);
+
+// Widens count RGB pixels to RGBA with alpha 255.
+void expand_rgb(const uint8_t *src, uint8_t *dst, int count);
+
+// Multiplies the color of count RGBA pixels by their alpha, rounded to nearest.
+void premultiply_pixels(uint8_t *pixels, int count);
@@ -1,44 +1,175 @@
 #define PNG_SKIP_SETJMP_CHECK
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <setjmp.h>
 #include <png.h>
+#include <zlib.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#if !defined(_WIN32)
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#define PNG_MMAP
+#endif
+
 #include "png.h"
+#include "../pixels.h"
+#include "../threadpool.h"
 
 namespace png {
 
-bool info(const char *path, int *width, int *height)
+struct MemoryReader
+{
+	const uint8_t *data;
+	size_t size;
+	size_t offset;
+};
+
+static void read_memory(png_structp png, png_bytep out, png_size_t length)
+{
+	MemoryReader *reader = (MemoryReader*)png_get_io_ptr(png);
+
+	if (length > reader->size - reader->offset)
+		png_error(png, "Unexpected end of data");
+
+	memcpy(out, reader->data + reader->offset, length);
+	reader->offset += length;
+}
+
+FileData::FileData() : data_(0), size_(0), mapped_(false)
+{
+}
+
+FileData::~FileData()
+{
+#ifdef PNG_MMAP
+	if (mapped_)
+		munmap((void*)data_, size_);
+#endif
+}
+
+bool FileData::open(const char *path, size_t map_size)
+{
+#ifdef PNG_MMAP
+	int fd = ::open(path, O_RDONLY);
+
+	if (fd == -1)
+		return false;
+
+	struct stat sb;
+
+	if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode))
+	{
+		close(fd);
+		return read_file(path);
+	}
+
+	size_ = sb.st_size;
+
+	if (size_ >= map_size)
+	{
+		void *map = mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (map != MAP_FAILED)
+		{
+			data_ = (const uint8_t*)map;
+			mapped_ = true;
+
+			close(fd);
+			return true;
+		}
+	}
+
+	buffer_.resize(size_);
+
+	size_t done = 0;
+
+	while (done < size_)
+	{
+		ssize_t n = read(fd, &buffer_[done], size_ - done);
+
+		if (n <= 0)
+			break;
+
+		done += n;
+	}
+
+	close(fd);
+
+	data_ = size_ > 0 ? &buffer_[0] : 0;
+
+	return done == size_;
+#else
+	return read_file(path);
+#endif
+}
+
+// for anything that isn't a regular file, like a pipe
+bool FileData::read_file(const char *path)
 {
 	FILE *file = fopen(path, "rb");
 
 	if (!file)
 		return false;
 
-	size_t headerSize = 8;
-	uint8_t header[8];
-	headerSize = fread(header, 1, headerSize, file);
+	uint8_t chunk[65536];
+	size_t n;
 
-	if (png_sig_cmp(header, 0, headerSize))
-	{
-		fclose(file);
+	while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		buffer_.insert(buffer_.end(), chunk, chunk + n);
+
+	bool success = !ferror(file);
+	fclose(file);
+
+	data_ = buffer_.empty() ? 0 : &buffer_[0];
+	size_ = buffer_.size();
+
+	return success;
+}
+
+bool info(const char *path, int *width, int *height, int *channels)
+{
+	// only the chunks before the image data are read
+	FileData file;
+	return file.open(path, 65536) && info(file.data(), file.size(), width, height, channels);
+}
+
+uint8_t *load(const char *path, int *width, int *height, int *channels)
+{
+	FileData file;
+	return file.open(path) ? load(file.data(), file.size(), width, height, channels) : 0;
+}
+
+bool trim_info(const char *path, int *width, int *height, int *channels, AlphaBounds *bounds)
+{
+	FileData file;
+	return file.open(path) && trim_info(file.data(), file.size(), width, height, channels, bounds);
+}
+
+bool info(const uint8_t *data, size_t size, int *width, int *height, int *channels)
+{
+	MemoryReader reader = { data, size, std::min<size_t>(size, 8) };
+
+	if (png_sig_cmp((png_const_bytep)data, 0, reader.offset))
 		return false;
-	}
 
 	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 
 	if (!png)
-	{
-		fclose(file);
 		return false;
-	}
 
 	png_infop info = png_create_info_struct(png);
 
 	if (!info)
 	{
 		png_destroy_read_struct(&png, NULL, NULL);
-		fclose(file);
 		return false;
 	}
 
@@ -47,61 +178,50 @@ bool info(const char *path, int *width, int *height)
 	if (!info_end)
 	{
 		png_destroy_read_struct(&png, &info, NULL);
-		fclose(file);
 		return false;
 	}
 
 	if (setjmp(png_jmpbuf(png)))
 	{
 		png_destroy_read_struct(&png, &info, &info_end);
-		fclose(file);
 		return false;
 	}
 
-	png_init_io(png, file);
-	png_set_sig_bytes(png, headerSize);
+	png_set_read_fn(png, &reader, read_memory);
+	png_set_sig_bytes(png, reader.offset);
 	png_read_info(png, info);
 
 	*width = png_get_image_width(png, info);
 	*height = png_get_image_height(png, info);
 
+	// channels after the transformations done by load()
+	int color = png_get_color_type(png, info);
+	bool alpha = (color & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS);
+
+	*channels = alpha ? 4 : 3;
+
 	png_destroy_read_struct(&png, &info, &info_end);
-	fclose(file);
 
 	return (*width > 0 && *height > 0);
 }
 
-uint8_t *load(const char *path, int *width, int *height, int *channels)
+uint8_t *load(const uint8_t *data, size_t size, int *width, int *height, int *channels)
 {
-	FILE *file = fopen(path, "rb");
+	MemoryReader reader = { data, size, std::min<size_t>(size, 8) };
 
-	if (!file)
+	if (png_sig_cmp((png_const_bytep)data, 0, reader.offset))
 		return 0;
 
-	size_t headerSize = 8;
-	uint8_t header[8];
-	headerSize = fread(header, 1, headerSize, file);
-
-	if (png_sig_cmp(header, 0, headerSize))
-	{
-		fclose(file);
-		return 0;
-	}
-
 	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 
 	if (!png)
-	{
-		fclose(file);
 		return 0;
-	}
 
 	png_infop info = png_create_info_struct(png);
 
 	if (!info)
 	{
 		png_destroy_read_struct(&png, NULL, NULL);
-		fclose(file);
 		return 0;
 	}
 
@@ -110,19 +230,17 @@ uint8_t *load(const char *path, int *width, int *height, int *channels)
 	if (!info_end)
 	{
 		png_destroy_read_struct(&png, &info, NULL);
-		fclose(file);
 		return 0;
 	}
 
 	if (setjmp(png_jmpbuf(png)))
 	{
 		png_destroy_read_struct(&png, &info, &info_end);
-		fclose(file);
 		return 0;
 	}
 
-	png_init_io(png, file);
-	png_set_sig_bytes(png, headerSize);
+	png_set_read_fn(png, &reader, read_memory);
+	png_set_sig_bytes(png, reader.offset);
 	png_read_png(png, info, PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING |
 		PNG_TRANSFORM_EXPAND | PNG_TRANSFORM_GRAY_TO_RGB, NULL);
 
@@ -133,7 +251,6 @@ uint8_t *load(const char *path, int *width, int *height, int *channels)
 	if (color != PNG_COLOR_TYPE_RGB && color != PNG_COLOR_TYPE_RGB_ALPHA)
 	{
 		png_destroy_read_struct(&png, &info, &info_end);
-		fclose(file);
 		return 0;
 	}
 
@@ -147,48 +264,628 @@ uint8_t *load(const char *path, int *width, int *height, int *channels)
 		memcpy(image + y * (*width) * (*channels), rows[y], (*width) * (*channels));
 
 	png_destroy_read_struct(&png, &info, &info_end);
-	fclose(file);
 
 	return image;
 }
 
-bool save(const char *filename, int width, int height, unsigned char *data)
+bool trim_info(const uint8_t *data, size_t size, int *width, int *height, int *channels, AlphaBounds *bounds)
 {
-	FILE *png_file = fopen(filename, "wb");
+	MemoryReader reader = { data, size, std::min<size_t>(size, 8) };
+
+	if (png_sig_cmp((png_const_bytep)data, 0, reader.offset))
+		return false;
+
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 
-	if (!png_file)
+	if (!png)
 		return false;
 
-	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png_create_info_struct(png);
 
-	if (!png_ptr)
+	if (!info)
+	{
+		png_destroy_read_struct(&png, NULL, NULL);
 		return false;
+	}
+
+	if (setjmp(png_jmpbuf(png)))
+	{
+		png_destroy_read_struct(&png, &info, NULL);
+		return false;
+	}
+
+	png_set_read_fn(png, &reader, read_memory);
+	png_set_sig_bytes(png, reader.offset);
+	png_read_info(png, info);
 
-	png_infop info_ptr = png_create_info_struct(png_ptr);
+	// same transformations as load()
+	png_set_strip_16(png);
+	png_set_packing(png);
+	png_set_expand(png);
+	png_set_gray_to_rgb(png);
 
-	if (!info_ptr)
+	const bool interlaced = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+
+	if (interlaced)
+		png_set_interlace_handling(png);
+
+	png_read_update_info(png, info);
+
+	int color = png_get_color_type(png, info);
+	*width = png_get_image_width(png, info);
+	*height = png_get_image_height(png, info);
+
+	if ((color != PNG_COLOR_TYPE_RGB && color != PNG_COLOR_TYPE_RGB_ALPHA) || *width <= 0 || *height <= 0)
+	{
+		png_destroy_read_struct(&png, &info, NULL);
 		return false;
+	}
 
-	png_init_io(png_ptr, png_file);
+	*channels = (color == PNG_COLOR_TYPE_RGB_ALPHA ? 4 : 3);
+
+	// there's nothing to trim without alpha
+	if (*channels == 3)
+	{
+		png_destroy_read_struct(&png, &info, NULL);
+		return true;
+	}
 
-	png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	// interlaced rows are only complete after the last pass, so these are decoded whole
+	const size_t pitch = png_get_rowbytes(png, info);
+	const int rows = interlaced ? *height : 1;
 
-	png_byte **row_ptrs = new png_byte*[height];
+	uint8_t *image = new uint8_t[pitch * rows];
+	png_bytep *row_ptrs = new png_bytep[rows];
 
-	for (int i = 0; i < height; i++)
-		row_ptrs[i] = data + i * width * 4;
+	for (int y = 0; y < rows; y++)
+		row_ptrs[y] = image + y * pitch;
 
-	png_set_rows(png_ptr, info_ptr, row_ptrs);
-	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+	if (setjmp(png_jmpbuf(png)))
+	{
+		delete[] row_ptrs;
+		delete[] image;
+		png_destroy_read_struct(&png, &info, NULL);
+		return false;
+	}
 
-	png_destroy_write_struct(&png_ptr, &info_ptr);
+	if (interlaced)
+	{
+		png_read_image(png, row_ptrs);
 
-	fclose(png_file);
+		for (int y = 0; y < *height; y++)
+			bounds->add_row(row_ptrs[y], y, *width);
+	}
+	else
+	{
+		for (int y = 0; y < *height; y++)
+		{
+			png_read_row(png, image, NULL);
+			bounds->add_row(image, y, *width);
+		}
+	}
 
 	delete[] row_ptrs;
+	delete[] image;
+
+	png_destroy_read_struct(&png, &info, NULL);
 
 	return true;
 }
 
+// The encoder below filters and deflates the image in strips of rows, one task per strip. Each
+// strip is a separate raw deflate stream primed with the end of the previous strip, so the
+// ratio stays close to a single stream. All strips but the last end with a sync flush, which
+// makes their concatenation a valid deflate stream. Strip size doesn't depend on the number
+// of threads, so the output is always the same. Writer takes the rows in batches of one strip
+// per thread, and only keeps the current batch and the deflate window in memory.
+
+static const size_t strip_bytes = 1 << 20;
+static const size_t window_bytes = 32768;
+static const size_t history_bytes = 65536;
+
+struct Strip
+{
+	std::vector<uint8_t> data;
+	uLong adler;
+	size_t length;
+	bool failed;
+};
+
+static int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+
+	return pb <= pc ? b : c;
+}
+
+static inline unsigned cost_of(uint8_t value)
+{
+	return value < 128 ? value : 256 - value;
+}
+
+// Filters a row with the given type into out and returns the sum of the absolute values of
+// the (signed) results. Stops early once the sum goes over limit.
+static unsigned apply_filter(int type, const uint8_t *row, const uint8_t *prev, size_t size, uint8_t *out,
+	unsigned limit)
+{
+	const size_t bpp = 4;
+
+	unsigned cost = 0;
+	size_t i;
+
+	switch (type)
+	{
+		case 0:
+			for (i = 0; i < size; i++)
+				cost += cost_of(out[i] = row[i]);
+			break;
+
+		case 1:
+			for (i = 0; i < bpp; i++)
+				cost += cost_of(out[i] = row[i]);
+
+			for (; i < size && cost <= limit; i++)
+				cost += cost_of(out[i] = row[i] - row[i - bpp]);
+			break;
+
+		case 2:
+			for (i = 0; i < size && cost <= limit; i++)
+				cost += cost_of(out[i] = row[i] - prev[i]);
+			break;
+
+		case 3:
+			for (i = 0; i < bpp; i++)
+				cost += cost_of(out[i] = row[i] - (prev[i] >> 1));
+
+			for (; i < size && cost <= limit; i++)
+				cost += cost_of(out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1));
+			break;
+
+		case 4:
+			for (i = 0; i < bpp; i++)
+				cost += cost_of(out[i] = row[i] - prev[i]);
+
+			for (; i < size && cost <= limit; i++)
+				cost += cost_of(out[i] = row[i] - paeth(row[i - bpp], prev[i], prev[i - bpp]));
+			break;
+	}
+
+	return cost;
+}
+
+static inline double xlog2(double x)
+{
+	return x > 1 ? x * log2(x) : 0;
+}
+
+// Byte counts of the recently filtered rows, halved whenever they add up to more than
+// history_bytes. The cost of a row is how much it adds to the entropy of the history, which
+// follows deflate's Huffman coding more closely than looking at the row alone.
+struct ByteHistory
+{
+	unsigned counts[256];
+	size_t total;
+
+	void reset()
+	{
+		memset(counts, 0, sizeof(counts));
+		total = 0;
+	}
+
+	double cost(const uint8_t *data, size_t size) const
+	{
+		unsigned row[256] = {};
+
+		for (size_t i = 0; i < size; i++)
+			row[data[i]]++;
+
+		double bits = xlog2(total + size) - xlog2(total);
+
+		for (int i = 0; i < 256; i++)
+		{
+			if (row[i] > 0)
+				bits -= xlog2(counts[i] + row[i]) - xlog2(counts[i]);
+		}
+
+		return bits;
+	}
+
+	void add(const uint8_t *data, size_t size)
+	{
+		for (size_t i = 0; i < size; i++)
+			counts[data[i]]++;
+
+		total += size;
+
+		if (total > history_bytes)
+		{
+			total = 0;
+
+			for (int i = 0; i < 256; i++)
+			{
+				counts[i] >>= 1;
+				total += counts[i];
+			}
+		}
+	}
+};
+
+// Writes the filter type followed by the filtered row to out. prev is 0 for the first row.
+static void filter_row(const uint8_t *row, const uint8_t *prev, size_t size, Filter filter, uint8_t *out,
+	uint8_t *scratch, ByteHistory &history)
+{
+	if (filter == FilterNone || filter == FilterSub)
+	{
+		out[0] = filter == FilterNone ? 0 : 1;
+		apply_filter(out[0], row, prev, size, out + 1, ~0u);
+		return;
+	}
+
+	uint8_t *best = out + 1;
+	uint8_t *candidate = scratch;
+
+	int best_type = 0;
+	unsigned best_cost = apply_filter(0, row, prev, size, best, ~0u);
+	double best_bits = filter == FilterSearch ? history.cost(best, size) : 0;
+
+	// up, average and paeth need the previous row, and are the same as none or sub without it
+	const int last_type = prev != 0 ? 4 : 1;
+
+	for (int type = 1; type <= last_type; type++)
+	{
+		if (filter == FilterAdaptive)
+		{
+			// like libpng, the smallest sum of absolute differences wins
+			unsigned cost = apply_filter(type, row, prev, size, candidate, best_cost);
+
+			if (cost >= best_cost)
+				continue;
+
+			best_cost = cost;
+		}
+		else
+		{
+			apply_filter(type, row, prev, size, candidate, ~0u);
+			double bits = history.cost(candidate, size);
+
+			if (bits >= best_bits)
+				continue;
+
+			best_bits = bits;
+		}
+
+		best_type = type;
+		std::swap(best, candidate);
+	}
+
+	if (best != out + 1)
+		memcpy(out + 1, best, size);
+
+	out[0] = best_type;
+
+	if (filter == FilterSearch)
+		history.add(out + 1, size);
+}
+
+// Filters count rows of size bytes into out. prev is the row before the first one or 0. history
+// is only used by FilterSearch, which picks filters based on the previous rows.
+static void filter_rows(const uint8_t *rows, const uint8_t *prev, size_t size, int count, Filter filter,
+	ByteHistory &history, uint8_t *out)
+{
+	std::vector<uint8_t> scratch(size);
+
+	for (int y = 0; y < count; y++)
+	{
+		const uint8_t *row = rows + y * size;
+
+		filter_row(row, prev, size, filter, out + y * (size + 1), &scratch[0], history);
+		prev = row;
+	}
+}
+
+// Deflates length bytes of filtered rows, with the dictionary bytes before them as the
+// preset dictionary.
+static void compress_strip(const uint8_t *input, size_t length, size_t dictionary, int level, Filter filter,
+	bool last, Strip &strip)
+{
+	strip.length = length;
+	strip.adler = adler32(adler32(0, 0, 0), input, length);
+	strip.failed = true;
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	const int strategy = filter == FilterNone ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+
+	if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, strategy) != Z_OK)
+		return;
+
+	if (dictionary > 0 && deflateSetDictionary(&stream, input - dictionary, dictionary) != Z_OK)
+	{
+		deflateEnd(&stream);
+		return;
+	}
+
+	strip.data.resize(deflateBound(&stream, length) + 16);
+
+	stream.next_in = (Bytef*)input;
+	stream.avail_in = length;
+
+	// a sync flush is complete once deflate leaves output space unused
+	int status;
+
+	do
+	{
+		size_t done = stream.total_out;
+
+		if (done == strip.data.size())
+			strip.data.resize(strip.data.size() * 2);
+
+		stream.next_out = &strip.data[done];
+		stream.avail_out = strip.data.size() - done;
+
+		status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+	}
+	while (status == Z_OK && (last || stream.avail_out == 0));
+
+	strip.data.resize(stream.total_out);
+	strip.failed = (status != (last ? Z_STREAM_END : Z_OK));
+
+	deflateEnd(&stream);
+}
+
+static void put_uint32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static bool write_chunk(FILE *file, const char *type, const uint8_t *data, size_t size)
+{
+	uint8_t header[8];
+	uint8_t footer[4];
+
+	put_uint32(header, size);
+	memcpy(header + 4, type, 4);
+
+	uLong crc = crc32(0, 0, 0);
+	crc = crc32(crc, header + 4, 4);
+
+	if (size > 0)
+		crc = crc32(crc, data, size);
+
+	put_uint32(footer, crc);
+
+	return fwrite(header, 1, 8, file) == 8 && (size == 0 || fwrite(data, 1, size, file) == size) &&
+		fwrite(footer, 1, 4, file) == 4;
+}
+
+Writer::Writer() :
+	file_(0),
+	history_(0)
+{
+}
+
+Writer::~Writer()
+{
+	if (file_ != 0)
+		fclose(file_);
+
+	delete history_;
+}
+
+bool Writer::open(const char *filename, int width, int height, int level, Filter filter, ThreadPool *pool)
+{
+	if (file_ != 0 || width <= 0 || height <= 0)
+		return false;
+
+	width_ = width;
+	height_ = height;
+	level_ = level < 0 || level > 9 ? Z_DEFAULT_COMPRESSION : level;
+	filter_ = filter;
+	pool_ = pool;
+
+	// strips are always the same rows, and one batch has a strip for each thread
+	const size_t row_size = (size_t)width * 4 + 1;
+
+	strip_rows_ = (int)std::max<size_t>(1, strip_bytes / row_size);
+	batch_rows_ = strip_rows_ * (pool != 0 ? pool->size() : 1);
+
+	rows_.resize((batch_rows_ + 1) * (size_t)width * 4);
+	pending_ = 0;
+	written_ = 0;
+
+	filtered_.clear();
+	adler_ = adler32(0, 0, 0);
+	failed_ = false;
+
+	delete history_;
+	history_ = new ByteHistory();
+	history_->reset();
+
+	file_ = fopen(filename, "wb");
+
+	if (!file_)
+		return false;
+
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+	uint8_t ihdr[13];
+
+	put_uint32(ihdr, width);
+	put_uint32(ihdr + 4, height);
+	ihdr[8] = 8;  // bit depth
+	ihdr[9] = 6;  // RGBA
+	ihdr[10] = 0; // deflate
+	ihdr[11] = 0; // adaptive filtering
+	ihdr[12] = 0; // no interlacing
+
+	failed_ = fwrite(signature, 1, 8, file_) != 8 || !write_chunk(file_, "IHDR", ihdr, 13);
+
+	return !failed_;
+}
+
+bool Writer::write_rows(const uint8_t *rows, int count)
+{
+	const size_t size = (size_t)width_ * 4;
+
+	if (file_ == 0 || failed_ || written_ + pending_ + count > height_)
+		return false;
+
+	while (count > 0)
+	{
+		// a full batch is only compressed once more rows come, so close() always has the last strip
+		if (pending_ == batch_rows_)
+			flush(false);
+
+		const int n = std::min(count, batch_rows_ - pending_);
+
+		memcpy(&rows_[(pending_ + 1) * size], rows, n * size);
+
+		pending_ += n;
+		rows += n * size;
+		count -= n;
+	}
+
+	return !failed_;
+}
+
+bool Writer::close()
+{
+	if (file_ == 0)
+		return false;
+
+	if (written_ + pending_ != height_)
+		failed_ = true;
+
+	if (!failed_)
+		flush(true);
+
+	failed_ = failed_ || !write_chunk(file_, "IEND", 0, 0);
+	failed_ = (fclose(file_) != 0) || failed_;
+	file_ = 0;
+
+	return !failed_;
+}
+
+// rows_ has the last row of the previous batch followed by the pending rows. filtered_ starts
+// with the end of the previous batch after filtering, which primes the deflate window.
+void Writer::flush(bool last)
+{
+	const size_t size = (size_t)width_ * 4;
+	const size_t row_size = size + 1;
+
+	const int count = pending_;
+	const size_t tail = filtered_.size();
+
+	const uint8_t *first = &rows_[size];
+	const uint8_t *prev = written_ > 0 ? &rows_[0] : 0;
+
+	std::vector<Strip> strips((count + strip_rows_ - 1) / strip_rows_);
+	filtered_.resize(tail + count * row_size);
+
+	if (filter_ == FilterSearch)
+	{
+		// the filter search depends on the rows before, so it can't be split
+		filter_rows(first, prev, size, count, filter_, *history_, &filtered_[tail]);
+	}
+	else
+	{
+		run(strips.size(), [&](size_t i)
+		{
+			const int y = i * strip_rows_;
+			const int n = std::min(count - y, strip_rows_);
+
+			ByteHistory history;
+			filter_rows(first + y * size, y > 0 ? first + (y - 1) * size : prev, size, n, filter_, history,
+				&filtered_[tail + y * row_size]);
+		});
+	}
+
+	run(strips.size(), [&](size_t i)
+	{
+		const size_t offset = tail + i * strip_rows_ * row_size;
+		const size_t length = std::min<size_t>(filtered_.size() - offset, strip_rows_ * row_size);
+
+		compress_strip(&filtered_[offset], length, std::min(offset, window_bytes), level_, filter_,
+			last && i + 1 == strips.size(), strips[i]);
+	});
+
+	for (size_t i = 0; i < strips.size() && !failed_; i++)
+	{
+		std::vector<uint8_t> &data = strips[i].data;
+
+		if (strips[i].failed)
+		{
+			failed_ = true;
+			break;
+		}
+
+		adler_ = adler32_combine(adler_, strips[i].adler, strips[i].length);
+
+		if (written_ == 0 && i == 0)
+		{
+			// zlib header for a 32K window, with the compression level hint
+			int hint = level_ == Z_DEFAULT_COMPRESSION ? 2 : level_ < 2 ? 0 : level_ < 6 ? 1 : level_ == 6 ? 2 : 3;
+			uint8_t header[2] = { 0x78, (uint8_t)(hint << 6) };
+			header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+
+			data.insert(data.begin(), header, header + 2);
+		}
+
+		if (last && i + 1 == strips.size())
+		{
+			uint8_t footer[4];
+			put_uint32(footer, adler_);
+
+			data.insert(data.end(), footer, footer + 4);
+		}
+
+		failed_ = !write_chunk(file_, "IDAT", &data[0], data.size());
+	}
+
+	// keep what the next batch needs
+	const size_t keep = std::min(filtered_.size(), window_bytes);
+	filtered_.erase(filtered_.begin(), filtered_.end() - keep);
+
+	memcpy(&rows_[0], &rows_[count * size], size);
+
+	written_ += count;
+	pending_ = 0;
+}
+
+void Writer::run(size_t count, const std::function<void(size_t)> &task)
+{
+	if (pool_ != 0)
+	{
+		pool_->run(count, task);
+	}
+	else
+	{
+		for (size_t i = 0; i < count; i++)
+			task(i);
+	}
+}
+
+bool save(const char *filename, int width, int height, const uint8_t *data, int level, Filter filter,
+	ThreadPool *pool)
+{
+	Writer writer;
+
+	if (!writer.open(filename, width, height, level, filter, pool))
+		return false;
+
+	writer.write_rows(data, height);
+
+	return writer.close();
+}
+
 } // namespace png
@@ -1,8 +1,111 @@
 #pragma once
 
+#include <cstdio>
+#include <functional>
+#include <vector>
+#include <stdint.h>
+
+struct AlphaBounds;
+class ThreadPool;
+
 namespace png
 {
-	bool info(const char *path, int *width, int *height);
+	// How rows are filtered before compression.
+	enum Filter
+	{
+		FilterNone,     // no filtering
+		FilterSub,      // sub filter on every row
+		FilterAdaptive, // per row, the filter with the smallest sum of absolute differences
+		FilterSearch    // per row, the filter that adds the least entropy to the previous rows
+	};
+
+	// The contents of a file. Files of at least map_size bytes are mapped into memory, so only
+	// the pages that get read are loaded; smaller ones are cheaper to read with a single call.
+	class FileData
+	{
+	public:
+		FileData();
+		~FileData();
+
+		bool open(const char *path, size_t map_size = 1 << 20);
+
+		const uint8_t *data() const { return data_; }
+		size_t size() const { return size_; }
+
+	private:
+		const uint8_t *data_;
+		size_t size_;
+		bool mapped_;
+		std::vector<uint8_t> buffer_;
+
+		bool read_file(const char *path);
+
+		FileData(const FileData&);
+		FileData &operator=(const FileData&);
+	};
+
+	// Files are read into memory in one go (large ones are mapped) and decoded from there.
+	bool info(const char *path, int *width, int *height, int *channels);
 	uint8_t *load(const char *path, int *width, int *height, int *channels);
-	bool save(const char *filename, int width, int height, unsigned char *data);
+
+	// Like info(), and for images with alpha also finds the bounds of the non-transparent
+	// pixels. Rows are decoded one at a time so the whole image is never in memory.
+	bool trim_info(const char *path, int *width, int *height, int *channels, AlphaBounds *bounds);
+
+	// The same for PNG data already in memory, like images read from an archive or a pipe.
+	bool info(const uint8_t *data, size_t size, int *width, int *height, int *channels);
+	uint8_t *load(const uint8_t *data, size_t size, int *width, int *height, int *channels);
+	bool trim_info(const uint8_t *data, size_t size, int *width, int *height, int *channels, AlphaBounds *bounds);
+
+	struct ByteHistory;
+
+	// Writes an RGBA image a few rows at a time, so the whole image never has to be in memory.
+	// level is the zlib compression level, -1 for the default. Strips of the image are
+	// compressed in parallel when a pool is given.
+	class Writer
+	{
+	public:
+		Writer();
+		~Writer();
+
+		bool open(const char *filename, int width, int height, int level = -1, Filter filter = FilterAdaptive,
+			ThreadPool *pool = 0);
+
+		// Adds the next count rows of the image, which are width * 4 bytes each.
+		bool write_rows(const uint8_t *rows, int count);
+
+		// Finishes the file. Fails if any write failed or not all the rows were written.
+		bool close();
+
+	private:
+		FILE *file_;
+
+		int width_;
+		int height_;
+		int level_;
+		Filter filter_;
+		ThreadPool *pool_;
+
+		int strip_rows_;
+		int batch_rows_;
+		int pending_;
+		int written_;
+
+		std::vector<uint8_t> rows_;
+		std::vector<uint8_t> filtered_;
+		ByteHistory *history_;
+
+		unsigned long adler_;
+		bool failed_;
+
+		void flush(bool last);
+		void run(size_t count, const std::function<void(size_t)> &task);
+
+		Writer(const Writer&);
+		Writer &operator=(const Writer&);
+	};
+
+	// Writes a whole RGBA image with a Writer.
+	bool save(const char *filename, int width, int height, const uint8_t *data, int level = -1,
+		Filter filter = FilterAdaptive, ThreadPool *pool = 0);
 }
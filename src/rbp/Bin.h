@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <functional>
+
+namespace rbp
+{
+	struct RectSize
+	{
+		int width;
+		int height;
+	};
+
+	struct Rect
+	{
+		int x;
+		int y;
+		int width;
+		int height;
+	};
+
+	// A packer for one bin, placing rects picked by index from a shared list of sizes.
+	class Bin
+	{
+	public:
+		Bin() : ordered_(false) {}
+		virtual ~Bin() {}
+
+		// Places the rects in the order of rects_indices, instead of the order the packer prefers.
+		void set_ordered(bool ordered) { ordered_ = ordered; }
+
+		// Rects that don't fit are left in rects_indices. With all_or_nothing, gives up as soon as
+		// one of them can't be placed anymore, for when a partial packing is of no use. give_up is
+		// checked between placements, to stop early when the packing isn't needed anymore.
+		virtual size_t insert(int mode, const std::vector<RectSize> &rects, std::vector<size_t> &rects_indices,
+			std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing = false,
+			const std::function<bool()> &give_up = std::function<bool()>()) = 0;
+
+		// Places a rect at a fixed position. Fails if the area isn't free.
+		virtual bool occupy(const Rect &rect) = 0;
+
+	protected:
+		bool ordered_;
+	};
+}
@@ -0,0 +1,326 @@
+#include <algorithm>
+
+#include "FreeList.h"
+#include "MaxRects.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+	#include <immintrin.h>
+
+	#if defined(_MSC_VER)
+		#include <intrin.h>
+		#define FREELIST_AVX2
+		#define TARGET_AVX2
+	#elif defined(__GNUC__)
+		#define FREELIST_AVX2
+		#define TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#endif
+
+namespace rbp {
+
+// Each kernel gets the arrays of count free rects. Same arguments as FreeList::score() and
+// FreeList::contains() otherwise.
+typedef void (*ScoreFunc)(const int *xs, const int *ys, const int *ws, const int *hs, size_t count,
+	int mode, int width, int height, bool rotate, int *status, int *score1, int *score2);
+typedef bool (*ContainsFunc)(const int *xs, const int *ys, const int *ws, const int *hs, size_t count,
+	const Rect &rect);
+
+struct Kernels
+{
+	ScoreFunc score;
+	ContainsFunc contains;
+};
+
+static inline void score_node(int mode, int x, int y, int freeWidth, int freeHeight, int width, int height,
+	int &score1, int &score2)
+{
+	int leftoverHoriz = freeWidth - width;
+	int leftoverVert = freeHeight - height;
+	int shortSideFit = std::min(leftoverHoriz, leftoverVert);
+	int longSideFit = std::max(leftoverHoriz, leftoverVert);
+
+	switch (mode)
+	{
+		case MaxRects::ShortSide:
+			score1 = shortSideFit;
+			score2 = longSideFit;
+			break;
+
+		case MaxRects::LongSide:
+			score1 = longSideFit;
+			score2 = shortSideFit;
+			break;
+
+		case MaxRects::BestArea:
+			score1 = freeWidth * freeHeight - width * height;
+			score2 = shortSideFit;
+			break;
+
+		case MaxRects::BottomLeft:
+			score1 = y + height;
+			score2 = x;
+			break;
+
+		default:
+			score1 = 0;
+			score2 = 0;
+			break;
+	}
+}
+
+static void score_scalar(const int *xs, const int *ys, const int *ws, const int *hs, size_t count,
+	int mode, int width, int height, bool rotate, int *status, int *score1, int *score2)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		int bits = 0;
+
+		if (ws[i] >= width && hs[i] >= height)
+		{
+			score_node(mode, xs[i], ys[i], ws[i], hs[i], width, height, score1[i], score2[i]);
+			bits = FreeList::Fits;
+		}
+
+		if (rotate && ws[i] >= height && hs[i] >= width)
+		{
+			int s1;
+			int s2;
+
+			score_node(mode, xs[i], ys[i], ws[i], hs[i], height, width, s1, s2);
+
+			if (bits == 0 || s1 < score1[i] || (s1 == score1[i] && s2 < score2[i]))
+			{
+				score1[i] = s1;
+				score2[i] = s2;
+				bits |= FreeList::Rotated;
+			}
+
+			bits |= FreeList::FitsRotated;
+		}
+
+		status[i] = bits;
+	}
+}
+
+static bool contains_scalar(const int *xs, const int *ys, const int *ws, const int *hs, size_t count,
+	const Rect &rect)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		if (rect.x >= xs[i] && rect.y >= ys[i] &&
+			rect.x + rect.width <= xs[i] + ws[i] &&
+			rect.y + rect.height <= ys[i] + hs[i])
+			return true;
+	}
+
+	return false;
+}
+
+#ifdef FREELIST_AVX2
+TARGET_AVX2 static inline void score_avx2(int mode, __m256i x, __m256i y, __m256i fw, __m256i fh,
+	__m256i w, __m256i h, __m256i &score1, __m256i &score2)
+{
+	__m256i horiz = _mm256_sub_epi32(fw, w);
+	__m256i vert = _mm256_sub_epi32(fh, h);
+
+	switch (mode)
+	{
+		case MaxRects::ShortSide:
+			score1 = _mm256_min_epi32(horiz, vert);
+			score2 = _mm256_max_epi32(horiz, vert);
+			break;
+
+		case MaxRects::LongSide:
+			score1 = _mm256_max_epi32(horiz, vert);
+			score2 = _mm256_min_epi32(horiz, vert);
+			break;
+
+		case MaxRects::BestArea:
+			score1 = _mm256_sub_epi32(_mm256_mullo_epi32(fw, fh), _mm256_mullo_epi32(w, h));
+			score2 = _mm256_min_epi32(horiz, vert);
+			break;
+
+		case MaxRects::BottomLeft:
+			score1 = _mm256_add_epi32(y, h);
+			score2 = x;
+			break;
+
+		default:
+			score1 = _mm256_setzero_si256();
+			score2 = _mm256_setzero_si256();
+			break;
+	}
+}
+
+TARGET_AVX2 static void score_avx2(const int *xs, const int *ys, const int *ws, const int *hs, size_t count,
+	int mode, int width, int height, bool rotate, int *status, int *score1, int *score2)
+{
+	const __m256i w = _mm256_set1_epi32(width);
+	const __m256i h = _mm256_set1_epi32(height);
+	const __m256i no_rotate = _mm256_set1_epi32(rotate ? 0 : -1);
+	const __m256i fits = _mm256_set1_epi32(FreeList::Fits);
+	const __m256i fits_rotated = _mm256_set1_epi32(FreeList::FitsRotated);
+	const __m256i rotated = _mm256_set1_epi32(FreeList::Rotated);
+
+	size_t i = 0;
+
+	// 8 free rects at a time, both orientations
+	for (; i + 8 <= count; i += 8)
+	{
+		const __m256i x = _mm256_loadu_si256((const __m256i *)(xs + i));
+		const __m256i y = _mm256_loadu_si256((const __m256i *)(ys + i));
+		const __m256i fw = _mm256_loadu_si256((const __m256i *)(ws + i));
+		const __m256i fh = _mm256_loadu_si256((const __m256i *)(hs + i));
+
+		const __m256i miss = _mm256_or_si256(_mm256_cmpgt_epi32(w, fw), _mm256_cmpgt_epi32(h, fh));
+		const __m256i miss_rotated = _mm256_or_si256(no_rotate,
+			_mm256_or_si256(_mm256_cmpgt_epi32(h, fw), _mm256_cmpgt_epi32(w, fh)));
+
+		__m256i a1, a2, b1, b2;
+
+		score_avx2(mode, x, y, fw, fh, w, h, a1, a2);
+		score_avx2(mode, x, y, fw, fh, h, w, b1, b2);
+
+		// the rotated fit is kept when the other one misses or scores worse
+		const __m256i better = _mm256_or_si256(_mm256_cmpgt_epi32(a1, b1),
+			_mm256_and_si256(_mm256_cmpeq_epi32(a1, b1), _mm256_cmpgt_epi32(a2, b2)));
+		const __m256i take = _mm256_andnot_si256(miss_rotated, _mm256_or_si256(miss, better));
+
+		const __m256i bits = _mm256_or_si256(_mm256_or_si256(_mm256_andnot_si256(miss, fits),
+			_mm256_andnot_si256(miss_rotated, fits_rotated)), _mm256_and_si256(take, rotated));
+
+		_mm256_storeu_si256((__m256i *)(status + i), bits);
+		_mm256_storeu_si256((__m256i *)(score1 + i), _mm256_blendv_epi8(a1, b1, take));
+		_mm256_storeu_si256((__m256i *)(score2 + i), _mm256_blendv_epi8(a2, b2, take));
+	}
+
+	// the tail is handled by code that isn't built for AVX, and GCC leaves out the vzeroupper
+	// before tail calls
+	_mm256_zeroupper();
+
+	score_scalar(xs + i, ys + i, ws + i, hs + i, count - i, mode, width, height, rotate,
+		status + i, score1 + i, score2 + i);
+}
+
+TARGET_AVX2 static bool contains_avx2(const int *xs, const int *ys, const int *ws, const int *hs, size_t count,
+	const Rect &rect)
+{
+	const __m256i x = _mm256_set1_epi32(rect.x);
+	const __m256i y = _mm256_set1_epi32(rect.y);
+	const __m256i right = _mm256_set1_epi32(rect.x + rect.width);
+	const __m256i bottom = _mm256_set1_epi32(rect.y + rect.height);
+
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		const __m256i fx = _mm256_loadu_si256((const __m256i *)(xs + i));
+		const __m256i fy = _mm256_loadu_si256((const __m256i *)(ys + i));
+		const __m256i fw = _mm256_loadu_si256((const __m256i *)(ws + i));
+		const __m256i fh = _mm256_loadu_si256((const __m256i *)(hs + i));
+
+		const __m256i outside = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpgt_epi32(fx, x), _mm256_cmpgt_epi32(fy, y)),
+			_mm256_or_si256(_mm256_cmpgt_epi32(right, _mm256_add_epi32(fx, fw)),
+				_mm256_cmpgt_epi32(bottom, _mm256_add_epi32(fy, fh))));
+
+		if (_mm256_movemask_epi8(outside) != -1)
+			return true;
+	}
+
+	_mm256_zeroupper();
+
+	return contains_scalar(xs + i, ys + i, ws + i, hs + i, count - i, rect);
+}
+
+static bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 0);
+
+	if (info[0] < 7)
+		return false;
+
+	// the OS has to save the YMM registers too
+	__cpuid(info, 1);
+
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+static Kernels select_kernels()
+{
+	Kernels kernels = { score_scalar, contains_scalar };
+
+#ifdef FREELIST_AVX2
+	if (cpu_has_avx2())
+	{
+		kernels.score = score_avx2;
+		kernels.contains = contains_avx2;
+	}
+#endif
+
+	return kernels;
+}
+
+static const Kernels kernels = select_kernels();
+
+void FreeList::set(size_t i, const Rect &rect)
+{
+	x_[i] = rect.x;
+	y_[i] = rect.y;
+	width_[i] = rect.width;
+	height_[i] = rect.height;
+}
+
+void FreeList::push_back(const Rect &rect)
+{
+	x_.push_back(rect.x);
+	y_.push_back(rect.y);
+	width_.push_back(rect.width);
+	height_.push_back(rect.height);
+}
+
+void FreeList::resize(size_t count)
+{
+	x_.resize(count);
+	y_.resize(count);
+	width_.resize(count);
+	height_.resize(count);
+}
+
+void FreeList::score(int mode, int width, int height, bool rotate, size_t first, int *status, int *score1,
+	int *score2) const
+{
+	if (first >= size())
+		return;
+
+	// most calls only score the few rects split off by the last placement, which is faster
+	// without the setup of the vector kernels
+	const size_t count = size() - first;
+	const ScoreFunc func = count < 8 ? score_scalar : kernels.score;
+
+	func(&x_[first], &y_[first], &width_[first], &height_[first], count, mode, width, height, rotate,
+		status, score1, score2);
+}
+
+bool FreeList::contains(const Rect &rect, size_t count) const
+{
+	if (count == 0)
+		return false;
+
+	return kernels.contains(&x_[0], &y_[0], &width_[0], &height_[0], count, rect);
+}
+
+}
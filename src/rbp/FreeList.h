@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Bin.h"
+
+namespace rbp
+{
+	// The free rects of a MaxRects bin, kept as separate arrays of x, y, width and height so that
+	// several of them can be tested at once, with kernels picked for the running CPU.
+	class FreeList
+	{
+	public:
+		// bits of the status of a free rect for a rect being placed
+		enum
+		{
+			Fits = 1,        // the rect fits as it is
+			FitsRotated = 2, // the rect fits rotated
+			Rotated = 4      // the scores are for the rotated rect
+		};
+
+		size_t size() const { return x_.size(); }
+
+		Rect get(size_t i) const
+		{
+			Rect rect = { x_[i], y_[i], width_[i], height_[i] };
+			return rect;
+		}
+
+		void set(size_t i, const Rect &rect);
+		void push_back(const Rect &rect);
+		void resize(size_t count);
+
+		// Tests a width x height rect against the free rects from first on, also rotated with
+		// rotate, and scores the fits with a MaxRects::Mode heuristic where lower is better. The
+		// status of free rect i goes to status[i - first] and the scores of its better fit to
+		// score1 and score2, the rotated one only when it scores strictly better. Nothing is scored
+		// with ContactPoint, which depends on more than the free rect.
+		void score(int mode, int width, int height, bool rotate, size_t first, int *status, int *score1,
+			int *score2) const;
+
+		// Whether one of the first count free rects contains rect.
+		bool contains(const Rect &rect, size_t count) const;
+
+	private:
+		std::vector<int> x_;
+		std::vector<int> y_;
+		std::vector<int> width_;
+		std::vector<int> height_;
+	};
+}
@@ -0,0 +1,261 @@
+#include <limits>
+#include <algorithm>
+#include <stdint.h>
+
+#include "Guillotine.h"
+
+namespace rbp {
+
+Guillotine::Guillotine(int width, int height, bool rotate)
+{
+	width_ = width;
+	height_ = height;
+	rotate_ = rotate;
+
+	Rect rect = { 0, 0, width, height };
+	free_.push_back(rect);
+}
+
+size_t Guillotine::insert(int mode, const std::vector<RectSize> &rects, std::vector<size_t> &rects_indices,
+	std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing,
+	const std::function<bool()> &give_up)
+{
+	result.clear();
+	result_indices.clear();
+
+	result.reserve(rects_indices.size());
+	result_indices.reserve(rects_indices.size());
+
+	const size_t n = rects_indices.size();
+
+	// largest first, then longest side, unless the caller ordered them
+	std::vector<size_t> order(n);
+
+	for (size_t i = 0; i < n; ++i)
+		order[i] = i;
+
+	if (!ordered_)
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			const RectSize &ra = rects[rects_indices[a]];
+			const RectSize &rb = rects[rects_indices[b]];
+
+			int area_a = ra.width * ra.height;
+			int area_b = rb.width * rb.height;
+
+			if (area_a != area_b)
+				return area_a > area_b;
+
+			return std::max(ra.width, ra.height) > std::max(rb.width, rb.height);
+		});
+
+	std::vector<bool> placed(n, false);
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (give_up && give_up())
+			break;
+
+		const RectSize &rect = rects[rects_indices[order[i]]];
+
+		Rect node;
+		size_t index;
+
+		if (!find(rect.width, rect.height, &node, &index))
+		{
+			if (all_or_nothing)
+				break;
+
+			continue;
+		}
+
+		Rect free = free_[index];
+		free_.erase(free_.begin() + index);
+		split(free, node);
+
+		result.push_back(node);
+		result_indices.push_back(rects_indices[order[i]]);
+		placed[order[i]] = true;
+	}
+
+	// rects that didn't fit stay in rects_indices in their original order
+	size_t count = 0;
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (!placed[i])
+			rects_indices[count++] = rects_indices[i];
+	}
+
+	rects_indices.resize(count);
+
+	return result.size();
+}
+
+bool Guillotine::occupy(const Rect &rect)
+{
+	// the free rects don't overlap, so the rect is free if they cover all of its area
+	int64_t covered = 0;
+
+	for (size_t i = 0; i < free_.size(); ++i)
+	{
+		const Rect &f = free_[i];
+
+		int w = std::min(f.x + f.width, rect.x + rect.width) - std::max(f.x, rect.x);
+		int h = std::min(f.y + f.height, rect.y + rect.height) - std::max(f.y, rect.y);
+
+		if (w > 0 && h > 0)
+			covered += (int64_t)w * h;
+	}
+
+	if (covered != (int64_t)rect.width * rect.height)
+		return false;
+
+	// each free rect it overlaps is cut into the parts left, right, above and below it
+	std::vector<Rect> overlapped;
+	size_t count = 0;
+
+	for (size_t i = 0; i < free_.size(); ++i)
+	{
+		const Rect &f = free_[i];
+
+		if (f.x < rect.x + rect.width && f.x + f.width > rect.x &&
+			f.y < rect.y + rect.height && f.y + f.height > rect.y)
+			overlapped.push_back(f);
+		else
+			free_[count++] = f;
+	}
+
+	free_.resize(count);
+
+	for (size_t i = 0; i < overlapped.size(); ++i)
+	{
+		const Rect &f = overlapped[i];
+
+		int left = std::max(f.x, rect.x);
+		int right = std::min(f.x + f.width, rect.x + rect.width);
+
+		Rect parts[4] = {
+			{ f.x, f.y, left - f.x, f.height },
+			{ right, f.y, f.x + f.width - right, f.height },
+			{ left, f.y, right - left, rect.y - f.y },
+			{ left, rect.y + rect.height, right - left, f.y + f.height - (rect.y + rect.height) }
+		};
+
+		for (int j = 0; j < 4; ++j)
+		{
+			if (parts[j].width > 0 && parts[j].height > 0)
+				add_free(parts[j]);
+		}
+	}
+
+	return true;
+}
+
+bool Guillotine::find(int width, int height, Rect *node, size_t *index) const
+{
+	int64_t best_area = std::numeric_limits<int64_t>::max();
+	int best_side = std::numeric_limits<int>::max();
+
+	for (size_t i = 0; i < free_.size(); ++i)
+	{
+		const Rect &f = free_[i];
+
+		for (int rotated = 0; rotated < (rotate_ ? 2 : 1); ++rotated)
+		{
+			int w = rotated ? height : width;
+			int h = rotated ? width : height;
+
+			if (f.width < w || f.height < h)
+				continue;
+
+			int64_t area = (int64_t)f.width * f.height - (int64_t)w * h;
+			int side = std::min(f.width - w, f.height - h);
+
+			if (area < best_area || (area == best_area && side < best_side))
+			{
+				best_area = area;
+				best_side = side;
+
+				node->x = f.x;
+				node->y = f.y;
+				node->width = w;
+				node->height = h;
+				*index = i;
+
+				// nothing beats a perfect fit
+				if (area == 0)
+					return true;
+			}
+		}
+	}
+
+	return best_area != std::numeric_limits<int64_t>::max();
+}
+
+void Guillotine::split(const Rect &free, const Rect &used)
+{
+	const int w = free.width - used.width;
+	const int h = free.height - used.height;
+
+	// the cut goes along the shorter leftover side, so the other part stays as large as possible
+	Rect bottom = { free.x, free.y + used.height, 0, h };
+	Rect right = { free.x + used.width, free.y, w, 0 };
+
+	if (w <= h)
+	{
+		bottom.width = free.width;
+		right.height = used.height;
+	}
+	else
+	{
+		bottom.width = used.width;
+		right.height = free.height;
+	}
+
+	if (bottom.width > 0 && bottom.height > 0)
+		add_free(bottom);
+
+	if (right.width > 0 && right.height > 0)
+		add_free(right);
+}
+
+void Guillotine::add_free(Rect rect)
+{
+	// merge with free rects that share a whole side, as long as there are any
+	bool merged = true;
+
+	while (merged)
+	{
+		merged = false;
+
+		for (size_t i = 0; i < free_.size(); ++i)
+		{
+			const Rect &f = free_[i];
+
+			if (f.x == rect.x && f.width == rect.width &&
+				(f.y + f.height == rect.y || rect.y + rect.height == f.y))
+			{
+				rect.y = std::min(rect.y, f.y);
+				rect.height += f.height;
+			}
+			else if (f.y == rect.y && f.height == rect.height &&
+				(f.x + f.width == rect.x || rect.x + rect.width == f.x))
+			{
+				rect.x = std::min(rect.x, f.x);
+				rect.width += f.width;
+			}
+			else
+			{
+				continue;
+			}
+
+			free_.erase(free_.begin() + i);
+			merged = true;
+			break;
+		}
+	}
+
+	free_.push_back(rect);
+}
+
+}
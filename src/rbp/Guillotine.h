@@ -0,0 +1,37 @@
+#pragma once
+
+#include "Bin.h"
+
+namespace rbp
+{
+	// Keeps the free space as a list of disjoint rects. Rects are placed largest first, each in
+	// the free rect it fills best, and what's left of that free rect is cut in two along the
+	// shorter leftover side. Free rects that line up again are merged back together.
+	class Guillotine : public Bin
+	{
+	public:
+		Guillotine(int width, int height, bool rotate = true);
+
+		enum Mode
+		{
+			BestArea = 1 // free rect with the least area left over
+		};
+
+		size_t insert(int mode, const std::vector<RectSize> &rects, std::vector<size_t> &rects_indices,
+			std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing = false,
+			const std::function<bool()> &give_up = std::function<bool()>());
+
+		bool occupy(const Rect &rect);
+
+	private:
+		int width_;
+		int height_;
+		bool rotate_;
+
+		std::vector<Rect> free_;
+
+		bool find(int width, int height, Rect *node, size_t *index) const;
+		void split(const Rect &free, const Rect &used);
+		void add_free(Rect rect);
+	};
+}
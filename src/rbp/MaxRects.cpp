@@ -27,6 +27,7 @@ MaxRects::MaxRects(int width, int height, bool rotate)
 	width_ = width;
 	height_ = height;
 	rotate_ = rotate;
+	first_new_free_ = 0;
 
 	Rect rect;
 
@@ -39,7 +40,8 @@ MaxRects::MaxRects(int width, int height, bool rotate)
 }
 
 size_t MaxRects::insert(int mode, const std::vector<RectSize> &rects, std::vector<size_t> &rects_indices,
-	std::vector<Rect> &result, std::vector<size_t> &result_indices)
+	std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing,
+	const std::function<bool()> &give_up)
 {
 	result.clear();
 	result_indices.clear();
@@ -47,35 +49,52 @@ size_t MaxRects::insert(int mode, const std::vector<RectSize> &rects, std::vecto
 	result.reserve(rects_indices.size());
 	result_indices.reserve(rects_indices.size());
 
-	std::vector<size_t> &idx = rects_indices;
+	// contact scores depend on the used rects, so they can't be kept between placements
+	if (ordered_)
+		insert_ordered(mode, rects, rects_indices, result, result_indices, all_or_nothing, give_up);
+	else if (mode == ContactPoint)
+		insert_cp(rects, rects_indices, result, result_indices, all_or_nothing, give_up);
+	else
+		insert_cached(mode, rects, rects_indices, result, result_indices, all_or_nothing, give_up);
 
+	return result.size();
+}
+
+void MaxRects::insert_cp(const std::vector<RectSize> &rects, std::vector<size_t> &idx,
+	std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing,
+	const std::function<bool()> &give_up)
+{
 	while (idx.size() > 0)
 	{
+		if (give_up && give_up())
+			return;
+
 		Rect bestNode;
 
-		int bestScore1 = std::numeric_limits<int>::max();
-		int bestScore2 = std::numeric_limits<int>::max();
+		int bestScore = std::numeric_limits<int>::min();
 		int bestRectIndex = -1;
 
 		for (size_t i = 0; i < idx.size(); ++i)
 		{
-			int score1;
-			int score2;
+			int score;
 
 			const RectSize &rect = rects[idx[i]];
 
-			Rect newNode = score_rect(rect.width, rect.height, mode, score1, score2);
+			Rect newNode = find_cp(rect.width, rect.height, score);
 
-			if (score1 < bestScore1 || (score1 == bestScore1 && score2 < bestScore2))
+			// free space only shrinks, so this one won't fit later either
+			if (newNode.height == 0 && all_or_nothing)
+				return;
+
+			if (newNode.height != 0 && score > bestScore)
 			{
-				bestScore1 = score1;
-				bestScore2 = score2;
+				bestScore = score;
 				bestNode = newNode;
 				bestRectIndex = i;
 			}
 		}
 
-		if (bestNode.height == 0 || bestRectIndex == -1)
+		if (bestRectIndex == -1)
 			break;
 
 		place_rect(bestNode);
@@ -84,256 +103,287 @@ size_t MaxRects::insert(int mode, const std::vector<RectSize> &rects, std::vecto
 		result_indices.push_back(idx[bestRectIndex]);
 		idx.erase(idx.begin() + bestRectIndex);
 	}
-
-	return result.size();
 }
 
-void MaxRects::place_rect(const Rect &node)
+void MaxRects::insert_cached(int mode, const std::vector<RectSize> &rects, std::vector<size_t> &idx,
+	std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing,
+	const std::function<bool()> &give_up)
 {
-	size_t numRectanglesToProcess = free_.size();
+	// Each rect keeps its best few fits, ordered by score and then by free rect index, which is
+	// how a full rescoring breaks ties. Scores don't change while a free rect exists, free rects
+	// that weren't split keep their relative order and new ones are appended after them. So
+	// after a placement the fits in split rects are dropped, and only the new free rects need
+	// to be scored. A rect is scored against all free rects again once all its fits are gone.
 
-	for (size_t i = 0; i < numRectanglesToProcess; ++i)
+	const size_t n = idx.size();
+
+	std::vector<Candidate> candidates(n);
+	std::vector<size_t> remaining;
+	std::vector<bool> placed(n, false);
+
+	remaining.reserve(n);
+
+	for (size_t i = 0; i < n; ++i)
 	{
-		if (split_free_node(free_[i], node))
+		candidates[i].count = 0;
+		rank_fits(rects[idx[i]], mode, 0, candidates[i]);
+
+		// a rect that doesn't fit now never will
+		if (candidates[i].count > 0)
+			remaining.push_back(i);
+		else if (all_or_nothing)
+			return;
+	}
+
+	while (remaining.size() > 0 && !(give_up && give_up()))
+	{
+		size_t best = 0;
+
+		for (size_t i = 1; i < remaining.size(); ++i)
 		{
-			free_.erase(free_.begin() + i);
-			--i;
-			--numRectanglesToProcess;
+			const Fit &a = candidates[remaining[i]].fits[0];
+			const Fit &b = candidates[remaining[best]].fits[0];
+
+			if (a.score1 < b.score1 || (a.score1 == b.score1 && a.score2 < b.score2))
+				best = i;
 		}
-	}
 
-	prune_free_list();
-	used_.push_back(node);
-}
+		const size_t k = remaining[best];
+		const Rect node = candidates[k].fits[0].node;
 
-Rect MaxRects::score_rect(int width, int height, int mode, int &score1, int &score2)
-{
-	Rect newNode;
+		place_rect(node);
 
-	score1 = std::numeric_limits<int>::max();
-	score2 = std::numeric_limits<int>::max();
+		result.push_back(node);
+		result_indices.push_back(idx[k]);
+		placed[k] = true;
 
-	switch (mode)
-	{
-		case ShortSide:
-			newNode = find_ss(width, height, score1, score2);
-			break;
+		// remaining stays in idx order, so ties still go to the first rect
+		remaining.erase(remaining.begin() + best);
 
-		case BottomLeft:
-			newNode = find_bl(width, height, score1, score2);
-			break;
+		size_t count = 0;
 
-		case ContactPoint:
-			newNode = find_cp(width, height, score1);
-			score1 = -score1;
-			break;
+		for (size_t i = 0; i < remaining.size(); ++i)
+		{
+			Candidate &c = candidates[remaining[i]];
 
-		case LongSide:
-			newNode = find_ls(width, height, score2, score1);
-			break;
+			int kept = 0;
+
+			for (int j = 0; j < c.count; ++j)
+			{
+				int free = free_remap_[c.fits[j].free];
+
+				if (free != -1)
+				{
+					c.fits[kept] = c.fits[j];
+					c.fits[kept++].free = free;
+				}
+			}
+
+			c.count = kept;
+
+			rank_fits(rects[idx[remaining[i]]], mode, kept > 0 ? first_new_free_ : 0, c);
+
+			if (c.count > 0)
+				remaining[count++] = remaining[i];
+		}
 
-		case BestArea:
-			newNode = find_ba(width, height, score1, score2);
+		if (all_or_nothing && count < remaining.size())
 			break;
+
+		remaining.resize(count);
 	}
 
-	if (newNode.height == 0)
+	// rects that didn't fit stay in idx in their original order
+	size_t count = 0;
+
+	for (size_t i = 0; i < n; ++i)
 	{
-		score1 = std::numeric_limits<int>::max();
-		score2 = std::numeric_limits<int>::max();
+		if (!placed[i])
+			idx[count++] = idx[i];
 	}
 
-	return newNode;
+	idx.resize(count);
 }
 
-Rect MaxRects::find_bl(int width, int height, int &bestY, int &bestX)
+void MaxRects::insert_ordered(int mode, const std::vector<RectSize> &rects, std::vector<size_t> &idx,
+	std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing,
+	const std::function<bool()> &give_up)
 {
-	Rect bestNode = {0};
+	// each rect goes to its best place in turn, so only the free rects are scored
+	const size_t n = idx.size();
 
-	bestY = std::numeric_limits<int>::max();
+	std::vector<bool> placed(n, false);
 
-	for (size_t i = 0; i < free_.size(); ++i)
+	for (size_t i = 0; i < n; ++i)
 	{
-		if (free_[i].width >= width && free_[i].height >= height)
+		if (give_up && give_up())
+			break;
+
+		const RectSize &rect = rects[idx[i]];
+
+		Rect node = {0};
+		bool found = false;
+
+		if (mode == ContactPoint)
+		{
+			int score;
+
+			node = find_cp(rect.width, rect.height, score);
+			found = node.height != 0;
+		}
+		else
 		{
-			int topSideY = free_[i].y + height;
+			score_free(rect.width, rect.height, mode, 0);
+
+			size_t best = 0;
 
-			if (topSideY < bestY || (topSideY == bestY && free_[i].x < bestX))
+			for (size_t j = 0; j < free_.size(); ++j)
 			{
-				bestNode.x = free_[i].x;
-				bestNode.y = free_[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestY = topSideY;
-				bestX = free_[i].x;
+				if (status_[j] != 0 && (!found || score1_[j] < score1_[best] ||
+					(score1_[j] == score1_[best] && score2_[j] < score2_[best])))
+				{
+					best = j;
+					found = true;
+				}
 			}
+
+			if (found)
+				node = make_fit(rect.width, rect.height, best, 0).node;
 		}
 
-		if (rotate_ && free_[i].width >= height && free_[i].height >= width)
+		if (!found)
 		{
-			int topSideY = free_[i].y + width;
+			if (all_or_nothing)
+				break;
 
-			if (topSideY < bestY || (topSideY == bestY && free_[i].x < bestX))
-			{
-				bestNode.x = free_[i].x;
-				bestNode.y = free_[i].y;
-				bestNode.width = height;
-				bestNode.height = width;
-				bestY = topSideY;
-				bestX = free_[i].x;
-			}
+			continue;
 		}
+
+		place_rect(node);
+
+		result.push_back(node);
+		result_indices.push_back(idx[i]);
+		placed[i] = true;
 	}
 
-	return bestNode;
+	// rects that didn't fit stay in idx in their original order
+	size_t count = 0;
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (!placed[i])
+			idx[count++] = idx[i];
+	}
+
+	idx.resize(count);
 }
 
-Rect MaxRects::find_ss(int width, int height, int &bestShortSideFit, int &bestLongSideFit)
+void MaxRects::rank_fits(const RectSize &rect, int mode, size_t first, Candidate &c)
 {
-	Rect bestNode = {0};
+	// fits can only be appended when the list holds the best fits of all free rects, otherwise
+	// a worse one could be ranked ahead of fits that were never added
+	const bool complete = (first == 0);
 
-	bestShortSideFit = std::numeric_limits<int>::max();
+	score_free(rect.width, rect.height, mode, first);
 
-	for (size_t i = 0; i < free_.size(); ++i)
+	for (size_t i = first; i < free_.size(); ++i)
 	{
-		if (free_[i].width >= width && free_[i].height >= height)
-		{
-			int leftoverHoriz = std::abs(free_[i].width - width);
-			int leftoverVert = std::abs(free_[i].height - height);
-			int shortSideFit = std::min(leftoverHoriz, leftoverVert);
-			int longSideFit = std::max(leftoverHoriz, leftoverVert);
+		const size_t k = i - first;
 
-			if (shortSideFit < bestShortSideFit ||
-				(shortSideFit == bestShortSideFit && longSideFit < bestLongSideFit))
-			{
-				bestNode.x = free_[i].x;
-				bestNode.y = free_[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestShortSideFit = shortSideFit;
-				bestLongSideFit = longSideFit;
-			}
-		}
+		if (status_[k] == 0)
+			continue;
 
-		if (rotate_ && free_[i].width >= height && free_[i].height >= width)
-		{
-			int flippedLeftoverHoriz = std::abs(free_[i].width - height);
-			int flippedLeftoverVert = std::abs(free_[i].height - width);
-			int flippedShortSideFit = std::min(flippedLeftoverHoriz, flippedLeftoverVert);
-			int flippedLongSideFit = std::max(flippedLeftoverHoriz, flippedLeftoverVert);
+		int j = c.count;
 
-			if (flippedShortSideFit < bestShortSideFit ||
-				(flippedShortSideFit == bestShortSideFit && flippedLongSideFit < bestLongSideFit))
-			{
-				bestNode.x = free_[i].x;
-				bestNode.y = free_[i].y;
-				bestNode.width = height;
-				bestNode.height = width;
-				bestShortSideFit = flippedShortSideFit;
-				bestLongSideFit = flippedLongSideFit;
-			}
+		// a fit in a later free rect only goes ahead of a strictly worse one
+		while (j > 0 && (score1_[k] < c.fits[j - 1].score1 ||
+			(score1_[k] == c.fits[j - 1].score1 && score2_[k] < c.fits[j - 1].score2)))
+		{
+			j--;
 		}
-	}
 
-	return bestNode;
+		if (j == max_fits || (j == c.count && !complete))
+			continue;
+
+		if (c.count < max_fits)
+			c.count++;
+
+		for (int m = c.count - 1; m > j; --m)
+			c.fits[m] = c.fits[m - 1];
+
+		c.fits[j] = make_fit(rect.width, rect.height, i, first);
+	}
 }
 
-Rect MaxRects::find_ls(int width, int height, int &bestShortSideFit, int &bestLongSideFit)
+void MaxRects::score_free(int width, int height, int mode, size_t first)
 {
-	Rect bestNode = {0};
-
-	bestLongSideFit = std::numeric_limits<int>::max();
+	const size_t count = free_.size() - first;
 
-	for (size_t i = 0; i < free_.size(); ++i)
+	if (status_.size() < count)
 	{
-		if (free_[i].width >= width && free_[i].height >= height)
-		{
-			int leftoverHoriz = std::abs(free_[i].width - width);
-			int leftoverVert = std::abs(free_[i].height - height);
-			int shortSideFit = std::min(leftoverHoriz, leftoverVert);
-			int longSideFit = std::max(leftoverHoriz, leftoverVert);
+		status_.resize(count);
+		score1_.resize(count);
+		score2_.resize(count);
+	}
 
-			if (longSideFit < bestLongSideFit ||
-				(longSideFit == bestLongSideFit && shortSideFit < bestShortSideFit))
-			{
-				bestNode.x = free_[i].x;
-				bestNode.y = free_[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestShortSideFit = shortSideFit;
-				bestLongSideFit = longSideFit;
-			}
-		}
+	free_.score(mode, width, height, rotate_, first, status_.data(), score1_.data(), score2_.data());
+}
 
-		if (rotate_ && free_[i].width >= height && free_[i].height >= width)
-		{
-			int leftoverHoriz = std::abs(free_[i].width - height);
-			int leftoverVert = std::abs(free_[i].height - width);
-			int shortSideFit = std::min(leftoverHoriz, leftoverVert);
-			int longSideFit = std::max(leftoverHoriz, leftoverVert);
+MaxRects::Fit MaxRects::make_fit(int width, int height, size_t i, size_t first)
+{
+	const size_t k = i - first;
+	const bool rotated = (status_[k] & FreeList::Rotated) != 0;
 
-			if (longSideFit < bestLongSideFit ||
-				(longSideFit == bestLongSideFit && shortSideFit < bestShortSideFit))
-			{
-				bestNode.x = free_[i].x;
-				bestNode.y = free_[i].y;
-				bestNode.width = height;
-				bestNode.height = width;
-				bestShortSideFit = shortSideFit;
-				bestLongSideFit = longSideFit;
-			}
-		}
-	}
+	Fit fit;
 
-	return bestNode;
+	fit.node = free_.get(i);
+	fit.node.width = rotated ? height : width;
+	fit.node.height = rotated ? width : height;
+	fit.score1 = score1_[k];
+	fit.score2 = score2_[k];
+	fit.free = i;
+
+	return fit;
 }
 
-Rect MaxRects::find_ba(int width, int height, int &bestAreaFit, int &bestShortSideFit)
+bool MaxRects::occupy(const Rect &rect)
 {
-	Rect bestNode = {0};
+	// every free area is inside one of the maximal free rects
+	if (!free_.contains(rect, free_.size()))
+		return false;
 
-	bestAreaFit = std::numeric_limits<int>::max();
+	place_rect(rect);
+	return true;
+}
+
+void MaxRects::place_rect(const Rect &node)
+{
+	size_t count = 0;
+
+	new_free_.clear();
+	free_remap_.resize(free_.size());
 
+	// rects that were split are removed, the rest keep their order
 	for (size_t i = 0; i < free_.size(); ++i)
 	{
-		int areaFit = free_[i].width * free_[i].height - width * height;
+		const Rect rect = free_.get(i);
 
-		if (free_[i].width >= width && free_[i].height >= height)
+		if (split_free_node(rect, node))
 		{
-			int leftoverHoriz = std::abs(free_[i].width - width);
-			int leftoverVert = std::abs(free_[i].height - height);
-			int shortSideFit = std::min(leftoverHoriz, leftoverVert);
-
-			if (areaFit < bestAreaFit || (areaFit == bestAreaFit && shortSideFit < bestShortSideFit))
-			{
-				bestNode.x = free_[i].x;
-				bestNode.y = free_[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestShortSideFit = shortSideFit;
-				bestAreaFit = areaFit;
-			}
+			free_remap_[i] = -1;
 		}
-
-		if (rotate_ && free_[i].width >= height && free_[i].height >= width)
+		else
 		{
-			int leftoverHoriz = std::abs(free_[i].width - height);
-			int leftoverVert = std::abs(free_[i].height - width);
-			int shortSideFit = std::min(leftoverHoriz, leftoverVert);
-
-			if (areaFit < bestAreaFit || (areaFit == bestAreaFit && shortSideFit < bestShortSideFit))
-			{
-				bestNode.x = free_[i].x;
-				bestNode.y = free_[i].y;
-				bestNode.width = height;
-				bestNode.height = width;
-				bestShortSideFit = shortSideFit;
-				bestAreaFit = areaFit;
-			}
+			free_remap_[i] = count;
+			free_.set(count++, rect);
 		}
 	}
 
-	return bestNode;
+	free_.resize(count);
+	first_new_free_ = count;
+
+	prune_free_list();
+	used_.push_back(node);
 }
 
 int MaxRects::score_node_cp(int x, int y, int width, int height)
@@ -364,30 +414,38 @@ Rect MaxRects::find_cp(int width, int height, int &bestContactScore)
 
 	bestContactScore = -1;
 
+	// only tests which free rects fit, the contact scores go through the used rects
+	score_free(width, height, ContactPoint, 0);
+
 	for (size_t i = 0; i < free_.size(); ++i)
 	{
-		if (free_[i].width >= width && free_[i].height >= height)
+		if (status_[i] == 0)
+			continue;
+
+		const Rect freeNode = free_.get(i);
+
+		if (status_[i] & FreeList::Fits)
 		{
-			int score = score_node_cp(free_[i].x, free_[i].y, width, height);
+			int score = score_node_cp(freeNode.x, freeNode.y, width, height);
 
 			if (score > bestContactScore)
 			{
-				bestNode.x = free_[i].x;
-				bestNode.y = free_[i].y;
+				bestNode.x = freeNode.x;
+				bestNode.y = freeNode.y;
 				bestNode.width = width;
 				bestNode.height = height;
 				bestContactScore = score;
 			}
 		}
 
-		if (rotate_ && free_[i].width >= height && free_[i].height >= width)
+		if (status_[i] & FreeList::FitsRotated)
 		{
-			int score = score_node_cp(free_[i].x, free_[i].y, height, width);
+			int score = score_node_cp(freeNode.x, freeNode.y, height, width);
 
 			if (score > bestContactScore)
 			{
-				bestNode.x = free_[i].x;
-				bestNode.y = free_[i].y;
+				bestNode.x = freeNode.x;
+				bestNode.y = freeNode.y;
 				bestNode.width = height;
 				bestNode.height = width;
 				bestContactScore = score;
@@ -410,7 +468,7 @@ bool MaxRects::split_free_node(Rect freeNode, const Rect &usedNode)
 		{
 			Rect newNode = freeNode;
 			newNode.height = usedNode.y - newNode.y;
-			free_.push_back(newNode);
+			new_free_.push_back(newNode);
 		}
 
 		if (usedNode.y + usedNode.height < freeNode.y + freeNode.height)
@@ -418,7 +476,7 @@ bool MaxRects::split_free_node(Rect freeNode, const Rect &usedNode)
 			Rect newNode = freeNode;
 			newNode.y = usedNode.y + usedNode.height;
 			newNode.height = freeNode.y + freeNode.height - (usedNode.y + usedNode.height);
-			free_.push_back(newNode);
+			new_free_.push_back(newNode);
 		}
 	}
 
@@ -428,7 +486,7 @@ bool MaxRects::split_free_node(Rect freeNode, const Rect &usedNode)
 		{
 			Rect newNode = freeNode;
 			newNode.width = usedNode.x - newNode.x;
-			free_.push_back(newNode);
+			new_free_.push_back(newNode);
 		}
 
 		if (usedNode.x + usedNode.width < freeNode.x + freeNode.width)
@@ -436,7 +494,7 @@ bool MaxRects::split_free_node(Rect freeNode, const Rect &usedNode)
 			Rect newNode = freeNode;
 			newNode.x = usedNode.x + usedNode.width;
 			newNode.width = freeNode.x + freeNode.width - (usedNode.x + usedNode.width);
-			free_.push_back(newNode);
+			new_free_.push_back(newNode);
 		}
 	}
 
@@ -445,23 +503,27 @@ bool MaxRects::split_free_node(Rect freeNode, const Rect &usedNode)
 
 void MaxRects::prune_free_list()
 {
-	for (size_t i = 0; i < free_.size(); ++i)
+	// The free rects that weren't split can't contain each other, and none of them can be
+	// inside a new rect because those are smaller than the rect they were split from. So only
+	// the new rects need to be checked, against all the others. When a new rect has duplicates
+	// only the last one is kept.
+
+	const size_t count = free_.size();
+
+	for (size_t i = 0; i < new_free_.size(); ++i)
 	{
-		for (size_t j = i + 1; j < free_.size(); ++j)
-		{
-			if (is_contained_in(free_[i], free_[j]))
-			{
-				free_.erase(free_.begin() + i);
-				--i;
-				break;
-			}
+		const Rect &rect = new_free_[i];
 
-			if (is_contained_in(free_[j], free_[i]))
-			{
-				free_.erase(free_.begin() + j);
-				--j;
-			}
+		bool contained = free_.contains(rect, count);
+
+		for (size_t j = 0; j < new_free_.size() && !contained; ++j)
+		{
+			if (j != i && is_contained_in(rect, new_free_[j]))
+				contained = (j > i || !is_contained_in(new_free_[j], rect));
 		}
+
+		if (!contained)
+			free_.push_back(rect);
 	}
 }
 
@@ -1,25 +1,11 @@
 #pragma once
 
-#include <vector>
-#include <cstddef>
+#include "Bin.h"
+#include "FreeList.h"
 
 namespace rbp
 {
-	struct RectSize
-	{
-		int width;
-		int height;
-	};
-
-	struct Rect
-	{
-		int x;
-		int y;
-		int width;
-		int height;
-	};
-
-	class MaxRects
+	class MaxRects : public Bin
 	{
 	public:
 		MaxRects(int width, int height, bool rotate = true);
@@ -34,7 +20,10 @@ namespace rbp
 		};
 
 		size_t insert(int mode, const std::vector<RectSize> &rects, std::vector<size_t> &rects_indices,
-			std::vector<Rect> &result, std::vector<size_t> &result_indices);
+			std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing = false,
+			const std::function<bool()> &give_up = std::function<bool()>());
+
+		bool occupy(const Rect &rect);
 
 	private:
 		int width_;
@@ -42,16 +31,48 @@ namespace rbp
 		bool rotate_;
 
 		std::vector<Rect> used_;
-		std::vector<Rect> free_;
+		FreeList free_;
+		std::vector<Rect> new_free_;
+
+		// FreeList::score() output for the rect being placed
+		std::vector<int> status_;
+		std::vector<int> score1_;
+		std::vector<int> score2_;
+
+		static const int max_fits = 16;
+
+		struct Fit
+		{
+			Rect node;
+			int score1;
+			int score2;
+			int free;
+		};
+
+		struct Candidate
+		{
+			Fit fits[max_fits];
+			int count;
+		};
+
+		std::vector<int> free_remap_;
+		size_t first_new_free_;
+
+		void insert_cp(const std::vector<RectSize> &rects, std::vector<size_t> &idx,
+			std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing,
+			const std::function<bool()> &give_up);
+		void insert_cached(int mode, const std::vector<RectSize> &rects, std::vector<size_t> &idx,
+			std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing,
+			const std::function<bool()> &give_up);
+		void insert_ordered(int mode, const std::vector<RectSize> &rects, std::vector<size_t> &idx,
+			std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing,
+			const std::function<bool()> &give_up);
+		void rank_fits(const RectSize &rect, int mode, size_t first, Candidate &c);
+		void score_free(int width, int height, int mode, size_t first);
+		Fit make_fit(int width, int height, size_t i, size_t first);
 
-		Rect score_rect(int width, int height, int mode, int &score1, int &score2);
 		void place_rect(const Rect &node);
 		int score_node_cp(int x, int y, int width, int height);
-
-		Rect find_bl(int width, int height, int &bestY, int &bestX);
-		Rect find_ss(int width, int height, int &bestShortSideFit, int &bestLongSideFit);
-		Rect find_ls(int width, int height, int &bestShortSideFit, int &bestLongSideFit);
-		Rect find_ba(int width, int height, int &bestAreaFit, int &bestShortSideFit);
 		Rect find_cp(int width, int height, int &contactScore);
 
 		bool split_free_node(Rect freeNode, const Rect &usedNode);
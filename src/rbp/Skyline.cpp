@@ -0,0 +1,250 @@
+#include <limits>
+#include <algorithm>
+
+#include "Skyline.h"
+
+namespace rbp {
+
+Skyline::Skyline(int width, int height, bool rotate)
+{
+	width_ = width;
+	height_ = height;
+	rotate_ = rotate;
+
+	Segment segment = { 0, 0, width };
+	skyline_.push_back(segment);
+}
+
+size_t Skyline::insert(int mode, const std::vector<RectSize> &rects, std::vector<size_t> &rects_indices,
+	std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing,
+	const std::function<bool()> &give_up)
+{
+	result.clear();
+	result_indices.clear();
+
+	result.reserve(rects_indices.size());
+	result_indices.reserve(rects_indices.size());
+
+	const size_t n = rects_indices.size();
+
+	// taller rects first, or longer sides when they can be rotated, unless the caller ordered them
+	std::vector<size_t> order(n);
+
+	for (size_t i = 0; i < n; ++i)
+		order[i] = i;
+
+	if (!ordered_)
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			const RectSize &ra = rects[rects_indices[a]];
+			const RectSize &rb = rects[rects_indices[b]];
+
+			int a1 = rotate_ ? std::max(ra.width, ra.height) : ra.height;
+			int b1 = rotate_ ? std::max(rb.width, rb.height) : rb.height;
+
+			if (a1 != b1)
+				return a1 > b1;
+
+			int a2 = rotate_ ? std::min(ra.width, ra.height) : ra.width;
+			int b2 = rotate_ ? std::min(rb.width, rb.height) : rb.width;
+
+			return a2 > b2;
+		});
+
+	std::vector<bool> placed(n, false);
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (give_up && give_up())
+			break;
+
+		const RectSize &rect = rects[rects_indices[order[i]]];
+
+		Rect node;
+		size_t index;
+
+		if (!find(mode, rect.width, rect.height, &node, &index))
+		{
+			if (all_or_nothing)
+				break;
+
+			continue;
+		}
+
+		add(index, node);
+
+		result.push_back(node);
+		result_indices.push_back(rects_indices[order[i]]);
+		placed[order[i]] = true;
+	}
+
+	// rects that didn't fit stay in rects_indices in their original order
+	size_t count = 0;
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (!placed[i])
+			rects_indices[count++] = rects_indices[i];
+	}
+
+	rects_indices.resize(count);
+
+	return result.size();
+}
+
+bool Skyline::occupy(const Rect &rect)
+{
+	if (rect.x < 0 || rect.y < 0 || rect.x + rect.width > width_ || rect.y + rect.height > height_)
+		return false;
+
+	for (size_t i = 0; i < skyline_.size(); ++i)
+	{
+		const Segment &s = skyline_[i];
+
+		if (s.x < rect.x + rect.width && s.x + s.width > rect.x && s.y > rect.y)
+			return false;
+	}
+
+	// the segments under the rect are cut at its sides and replaced by its top
+	std::vector<Segment> skyline;
+	bool added = false;
+
+	for (size_t i = 0; i < skyline_.size(); ++i)
+	{
+		const Segment &s = skyline_[i];
+
+		if (s.x < rect.x)
+		{
+			Segment left = { s.x, s.y, std::min(s.width, rect.x - s.x) };
+			skyline.push_back(left);
+		}
+
+		if (s.x + s.width > rect.x && !added)
+		{
+			Segment top = { rect.x, rect.y + rect.height, rect.width };
+			skyline.push_back(top);
+			added = true;
+		}
+
+		if (s.x + s.width > rect.x + rect.width)
+		{
+			int x = std::max(s.x, rect.x + rect.width);
+
+			Segment right = { x, s.y, s.x + s.width - x };
+			skyline.push_back(right);
+		}
+	}
+
+	skyline_.swap(skyline);
+	merge();
+
+	return true;
+}
+
+bool Skyline::fits(size_t index, int width, int height, int *y, int *waste) const
+{
+	const int x = skyline_[index].x;
+
+	if (x + width > width_)
+		return false;
+
+	int top = 0;
+
+	for (size_t i = index; i < skyline_.size() && skyline_[i].x < x + width; ++i)
+		top = std::max(top, skyline_[i].y);
+
+	if (top + height > height_)
+		return false;
+
+	*y = top;
+	*waste = 0;
+
+	for (size_t i = index; i < skyline_.size() && skyline_[i].x < x + width; ++i)
+	{
+		int right = std::min(skyline_[i].x + skyline_[i].width, x + width);
+		*waste += (top - skyline_[i].y) * (right - skyline_[i].x);
+	}
+
+	return true;
+}
+
+bool Skyline::find(int mode, int width, int height, Rect *node, size_t *index) const
+{
+	int best1 = std::numeric_limits<int>::max();
+	int best2 = std::numeric_limits<int>::max();
+
+	for (size_t i = 0; i < skyline_.size(); ++i)
+	{
+		for (int rotated = 0; rotated < (rotate_ ? 2 : 1); ++rotated)
+		{
+			int w = rotated ? height : width;
+			int h = rotated ? width : height;
+			int y;
+			int waste;
+
+			if (!fits(i, w, h, &y, &waste))
+				continue;
+
+			int score1 = mode == MinWaste ? waste : y + h;
+			int score2 = mode == MinWaste ? y + h : skyline_[i].width;
+
+			if (score1 < best1 || (score1 == best1 && score2 < best2))
+			{
+				best1 = score1;
+				best2 = score2;
+
+				node->x = skyline_[i].x;
+				node->y = y;
+				node->width = w;
+				node->height = h;
+				*index = i;
+			}
+		}
+	}
+
+	return best1 != std::numeric_limits<int>::max();
+}
+
+void Skyline::add(size_t index, const Rect &rect)
+{
+	Segment segment = { rect.x, rect.y + rect.height, rect.width };
+	skyline_.insert(skyline_.begin() + index, segment);
+
+	// the segments under the rect are shortened from the left, or removed
+	const int right = rect.x + rect.width;
+	size_t i = index + 1;
+
+	while (i < skyline_.size() && skyline_[i].x < right)
+	{
+		int shrink = right - skyline_[i].x;
+
+		if (skyline_[i].width <= shrink)
+		{
+			skyline_.erase(skyline_.begin() + i);
+		}
+		else
+		{
+			skyline_[i].x += shrink;
+			skyline_[i].width -= shrink;
+			break;
+		}
+	}
+
+	merge();
+}
+
+void Skyline::merge()
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < skyline_.size(); ++i)
+	{
+		if (count > 0 && skyline_[count - 1].y == skyline_[i].y)
+			skyline_[count - 1].width += skyline_[i].width;
+		else
+			skyline_[count++] = skyline_[i];
+	}
+
+	skyline_.resize(count);
+}
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "Bin.h"
+
+namespace rbp
+{
+	// Keeps the top edge of the packed rects as a list of horizontal segments and puts each rect
+	// on top of it, taller rects first. The space a rect leaves under it is lost, so it packs
+	// less densely than MaxRects, but a placement only has to look at the segments.
+	class Skyline : public Bin
+	{
+	public:
+		Skyline(int width, int height, bool rotate = true);
+
+		enum Mode
+		{
+			BottomLeft = 1, // lowest top edge
+			MinWaste        // least space left under the rect
+		};
+
+		size_t insert(int mode, const std::vector<RectSize> &rects, std::vector<size_t> &rects_indices,
+			std::vector<Rect> &result, std::vector<size_t> &result_indices, bool all_or_nothing = false,
+			const std::function<bool()> &give_up = std::function<bool()>());
+
+		// Only works on top of the skyline, the space under the rect is lost.
+		bool occupy(const Rect &rect);
+
+	private:
+		struct Segment
+		{
+			int x;
+			int y;
+			int width;
+		};
+
+		int width_;
+		int height_;
+		bool rotate_;
+
+		std::vector<Segment> skyline_;
+
+		bool fits(size_t index, int width, int height, int *y, int *waste) const;
+		bool find(int mode, int width, int height, Rect *node, size_t *index) const;
+		void add(size_t index, const Rect &rect);
+		void merge();
+	};
+}
@@ -0,0 +1,117 @@
+#include "spritestore.h"
+#include <climits>
+#include <cstring>
+
+SpriteStore::SpriteStore(size_t budget)
+{
+	budget_ = budget;
+	used_ = 0;
+	spill_ = 0;
+	spill_size_ = 0;
+	spill_failed_ = false;
+}
+
+SpriteStore::~SpriteStore()
+{
+	for (size_t i = 0; i < entries_.size(); i++)
+		delete[] entries_[i].data;
+
+	if (spill_ != 0)
+		fclose(spill_);
+}
+
+void SpriteStore::put(size_t index, const uint8_t *data, int width, int height, int channels, int pitch)
+{
+	if (!enabled())
+		return;
+
+	const size_t row_size = width * channels;
+	const size_t size = row_size * height;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (index >= entries_.size())
+			entries_.resize(index + 1);
+
+		if (used_ + size <= budget_)
+		{
+			used_ += size;
+		}
+		else
+		{
+			if (spill_ == 0 && !spill_failed_)
+			{
+				spill_ = tmpfile();
+				spill_failed_ = (spill_ == 0);
+			}
+
+			if (spill_ == 0 || size > (size_t)(LONG_MAX - spill_size_))
+				return;
+
+			if (fseek(spill_, spill_size_, SEEK_SET) != 0)
+				return;
+
+			for (int y = 0; y < height; y++)
+			{
+				if (fwrite(data + y * pitch, 1, row_size, spill_) != row_size)
+					return;
+			}
+
+			Entry &entry = entries_[index];
+
+			entry.offset = spill_size_;
+			entry.size = size;
+			entry.channels = channels;
+
+			spill_size_ += size;
+			return;
+		}
+	}
+
+	uint8_t *copy = new uint8_t[size];
+
+	for (int y = 0; y < height; y++)
+		memcpy(copy + y * row_size, data + y * pitch, row_size);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	Entry &entry = entries_[index];
+
+	entry.data = copy;
+	entry.size = size;
+	entry.channels = channels;
+}
+
+uint8_t *SpriteStore::take(size_t index, int *channels)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (index >= entries_.size())
+		return 0;
+
+	Entry &entry = entries_[index];
+	uint8_t *data = 0;
+
+	if (entry.data != 0)
+	{
+		data = entry.data;
+		used_ -= entry.size;
+	}
+	else if (entry.offset >= 0)
+	{
+		data = new uint8_t[entry.size];
+
+		if (fseek(spill_, entry.offset, SEEK_SET) != 0 ||
+			fread(data, 1, entry.size, spill_) != entry.size)
+		{
+			delete[] data;
+			data = 0;
+		}
+	}
+
+	*channels = entry.channels;
+	entry = Entry();
+
+	return data;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+// Keeps decoded sprite pixels from the time they're read until they're copied into the atlas,
+// so each file only needs to be decoded once. Pixels beyond the memory budget are spilled to
+// a temporary file. If that isn't possible nothing is stored and the sprite gets decoded again.
+class SpriteStore
+{
+public:
+	// budget is the number of bytes that can be kept in memory, 0 disables the store
+	SpriteStore(size_t budget);
+	~SpriteStore();
+
+	bool enabled() const { return budget_ > 0; }
+
+	// Stores a width x height block of pixels. Consecutive rows are pitch bytes apart in data.
+	void put(size_t index, const uint8_t *data, int width, int height, int channels, int pitch);
+
+	// Removes the pixels stored for index and returns them with tightly packed rows. The caller
+	// owns the returned buffer (allocated with new[]). Returns 0 if nothing was stored.
+	uint8_t *take(size_t index, int *channels);
+
+private:
+	struct Entry
+	{
+		Entry() : data(0), offset(-1), size(0), channels(0) {}
+
+		uint8_t *data;
+		long offset;
+		size_t size;
+		int channels;
+	};
+
+	size_t budget_;
+	size_t used_;
+
+	FILE *spill_;
+	long spill_size_;
+	bool spill_failed_;
+
+	std::vector<Entry> entries_;
+	std::mutex mutex_;
+
+	SpriteStore(const SpriteStore&);
+	SpriteStore &operator=(const SpriteStore&);
+};
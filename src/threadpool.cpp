@@ -0,0 +1,131 @@
+#include "threadpool.h"
+
+static thread_local bool inside_task = false;
+
+ThreadPool::ThreadPool(int jobs)
+{
+	task_ = 0;
+	count_ = 0;
+	generation_ = 0;
+	active_ = 0;
+	quit_ = false;
+
+	next_ = 0;
+	pending_ = 0;
+
+	if (jobs <= 0)
+		jobs = hardware_jobs();
+
+	for (int i = 1; i < jobs; i++)
+		workers_.push_back(std::thread(&ThreadPool::worker, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		quit_ = true;
+	}
+
+	wake_.notify_all();
+
+	for (size_t i = 0; i < workers_.size(); i++)
+		workers_[i].join();
+}
+
+int ThreadPool::hardware_jobs()
+{
+	int n = std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+void ThreadPool::run(size_t count, const std::function<void(size_t)> &task)
+{
+	if (workers_.empty() || count <= 1 || inside_task)
+	{
+		for (size_t i = 0; i < count; i++)
+			task(i);
+
+		return;
+	}
+
+	std::lock_guard<std::mutex> run_lock(run_mutex_);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		task_ = &task;
+		count_ = count;
+		next_ = 0;
+		pending_ = count;
+		generation_++;
+	}
+
+	wake_.notify_all();
+
+	inside_task = true;
+	work(task, count);
+	inside_task = false;
+
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	while (pending_ > 0 || active_ > 0)
+		done_.wait(lock);
+
+	task_ = 0;
+}
+
+void ThreadPool::work(const std::function<void(size_t)> &task, size_t count)
+{
+	for (size_t i = next_++; i < count; i = next_++)
+	{
+		task(i);
+
+		if (--pending_ == 0)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			done_.notify_all();
+		}
+	}
+}
+
+void ThreadPool::worker()
+{
+	size_t generation = 0;
+
+	inside_task = true;
+
+	while (true)
+	{
+		const std::function<void(size_t)> *task;
+		size_t count;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+
+			while (!quit_ && generation == generation_)
+				wake_.wait(lock);
+
+			if (quit_)
+				return;
+
+			generation = generation_;
+
+			if (task_ == 0)
+				continue;
+
+			task = task_;
+			count = count_;
+			active_++;
+		}
+
+		work(*task, count);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			active_--;
+		}
+
+		done_.notify_all();
+	}
+}
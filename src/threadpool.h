@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+	// jobs is the total number of threads running tasks, including the caller of run().
+	// A value of 0 or less uses one thread per hardware core.
+	ThreadPool(int jobs = 0);
+	~ThreadPool();
+
+	int size() const { return workers_.size() + 1; }
+
+	// Calls task(i) for every i in [0, count) and returns when all of them finished. Calls
+	// made from inside a running task are executed serially on the calling thread.
+	void run(size_t count, const std::function<void(size_t)> &task);
+
+	static int hardware_jobs();
+
+private:
+	std::vector<std::thread> workers_;
+
+	std::mutex run_mutex_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable done_;
+
+	const std::function<void(size_t)> *task_;
+	size_t count_;
+	size_t generation_;
+	size_t active_;
+	bool quit_;
+
+	std::atomic<size_t> next_;
+	std::atomic<size_t> pending_;
+
+	void worker();
+	void work(const std::function<void(size_t)> &task, size_t count);
+
+	ThreadPool(const ThreadPool&);
+	ThreadPool &operator=(const ThreadPool&);
+};
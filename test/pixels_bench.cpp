@@ -0,0 +1,250 @@
+// Checks the SIMD kernels of pixels.cpp against the scalar ones and times them, along with the
+// loops they replaced. Build and run from the repository root:
+//
+//   c++ -O2 -std=c++11 -o pixels_bench test/pixels_bench.cpp && ./pixels_bench
+//
+// Exits with 1 if any kernel gives a different result than the scalar one.
+
+#include "../src/pixels.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+struct Variant
+{
+	const char *name;
+	Kernels kernels;
+};
+
+static std::vector<Variant> variants()
+{
+	std::vector<Variant> list;
+
+	Kernels scalar = { first_scalar, last_scalar, rotate_scalar, expand_scalar, premultiply_scalar };
+	Variant v = { "scalar", scalar };
+	list.push_back(v);
+
+#ifdef PIXELS_SSE2
+	Kernels sse2 = { first_sse2, last_sse2, rotate_sse2, expand_scalar, premultiply_sse2 };
+	v.name = "sse2";
+	v.kernels = sse2;
+	list.push_back(v);
+
+#ifdef PIXELS_SSSE3
+	if (cpu_has_ssse3())
+	{
+		v.name = "ssse3";
+		v.kernels.expand = expand_ssse3;
+		list.push_back(v);
+	}
+#endif
+#endif
+
+#ifdef PIXELS_AVX2
+	if (cpu_has_avx2())
+	{
+		Kernels avx2 = { first_avx2, last_avx2, rotate_avx2, expand_avx2, premultiply_avx2 };
+		v.name = "avx2";
+		v.kernels = avx2;
+		list.push_back(v);
+	}
+#endif
+
+#ifdef PIXELS_NEON
+	Kernels neon = { first_neon, last_neon, rotate_neon, expand_neon, premultiply_neon };
+	v.name = "neon";
+	v.kernels = neon;
+	list.push_back(v);
+#endif
+
+	return list;
+}
+
+// the loops used before the kernels, for timing only since premultiplying truncated
+static void expand_old(const uint8_t *src, uint8_t *dst, int count)
+{
+	for (int xs = 0, xd = 0; xs < count * 3; xs += 3, xd += 4)
+	{
+		dst[xd + 0] = src[xs + 0];
+		dst[xd + 1] = src[xs + 1];
+		dst[xd + 2] = src[xs + 2];
+		dst[xd + 3] = 0xFF;
+	}
+}
+
+static void premultiply_old(uint8_t *pixels, int count)
+{
+	for (uint8_t *p = pixels; p < pixels + count * 4; p++)
+	{
+		float alpha = p[3] / 255.f;
+
+		*p++ *= alpha;
+		*p++ *= alpha;
+		*p++ *= alpha;
+	}
+}
+
+static std::vector<uint8_t> random_bytes(size_t size)
+{
+	std::vector<uint8_t> data(size);
+
+	for (size_t i = 0; i < size; i++)
+		data[i] = rand() & 0xFF;
+
+	return data;
+}
+
+static int failures = 0;
+
+static void check(bool ok, const char *variant, const char *kernel, int arg)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "%s %s differs from scalar (%d)\n", variant, kernel, arg);
+		failures++;
+	}
+}
+
+static void check_variant(const Variant &v)
+{
+	const Kernels &k = v.kernels;
+
+	// rows with one visible pixel or none, at every position for a few lengths
+	for (int count = 0; count < 100; count++)
+	{
+		for (int visible = -1; visible < count; visible++)
+		{
+			std::vector<uint8_t> row(count * 4 + 4, 0);
+
+			if (visible >= 0)
+				row[visible * 4 + 3] = 1;
+
+			check(k.find_first(&row[0], count) == first_scalar(&row[0], count), v.name, "find_first", count);
+			check(k.find_last(&row[0], count) == last_scalar(&row[0], count), v.name, "find_last", count);
+		}
+	}
+
+	for (int channels = 3; channels <= 4; channels++)
+	{
+		for (int i = 0; i < 200; i++)
+		{
+			const int width = 1 + rand() % 70;
+			const int height = 1 + rand() % 70;
+			const int srcpitch = width * channels + rand() % 8;
+			const int dstpitch = height * 4 + rand() % 8;
+
+			std::vector<uint8_t> src = random_bytes(srcpitch * height);
+			std::vector<uint8_t> expected(dstpitch * width, 0);
+			std::vector<uint8_t> actual(dstpitch * width, 0);
+
+			rotate_scalar(&src[0], srcpitch, channels, width, height, &expected[0], dstpitch);
+			k.rotate(&src[0], srcpitch, channels, width, height, &actual[0], dstpitch);
+
+			check(expected == actual, v.name, "rotate", channels);
+		}
+	}
+
+	for (int count = 0; count < 70; count++)
+	{
+		// expand may read a few bytes past the pixels
+		std::vector<uint8_t> src = random_bytes(count * 3 + 16);
+		std::vector<uint8_t> expected(count * 4 + 16, 0);
+		std::vector<uint8_t> actual(count * 4 + 16, 0);
+
+		expand_scalar(&src[0], &expected[0], count);
+		k.expand(&src[0], &actual[0], count);
+
+		check(expected == actual, v.name, "expand", count);
+
+		// the bytes after the last pixel are left alone
+		std::vector<uint8_t> pixels = random_bytes(count * 4 + 16);
+		std::vector<uint8_t> copy = pixels;
+
+		premultiply_scalar(&pixels[0], count);
+		k.premultiply(&copy[0], count);
+
+		check(pixels == copy, v.name, "premultiply", count);
+	}
+
+	// every color and alpha pair
+	std::vector<uint8_t> pairs(65536 * 4);
+
+	for (int i = 0; i < 65536; i++)
+	{
+		pairs[i * 4 + 0] = i & 0xFF;
+		pairs[i * 4 + 1] = i & 0xFF;
+		pairs[i * 4 + 2] = i & 0xFF;
+		pairs[i * 4 + 3] = i >> 8;
+	}
+
+	std::vector<uint8_t> copy = pairs;
+
+	premultiply_scalar(&pairs[0], 65536);
+	k.premultiply(&copy[0], 65536);
+
+	check(pairs == copy, v.name, "premultiply", 65536);
+}
+
+template <typename F>
+static double time_ms(F func)
+{
+	const int runs = 10;
+
+	func();
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < runs; i++)
+		func();
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+	return elapsed.count() / runs;
+}
+
+int main()
+{
+	const int count = 4 << 20;
+	const int side = 2048;
+
+	std::vector<Variant> list = variants();
+
+	for (size_t i = 0; i < list.size(); i++)
+		check_variant(list[i]);
+
+	std::vector<uint8_t> rgb = random_bytes(count * 3 + 16);
+	std::vector<uint8_t> rgba = random_bytes(count * 4);
+	std::vector<uint8_t> image = random_bytes(side * side * 4);
+	std::vector<uint8_t> buffer(count * 4);
+	std::vector<uint8_t> empty(count * 4, 0);
+
+	printf("%-8s %10s %10s %10s %10s %10s\n", "ms", "expand", "premult", "rotate", "rotate rgb", "bounds");
+
+	printf("%-8s %10.2f %10.2f\n", "old",
+		time_ms([&]() { expand_old(&rgb[0], &buffer[0], count); }),
+		time_ms([&]() { buffer = rgba; premultiply_old(&buffer[0], count); }));
+
+	for (size_t i = 0; i < list.size(); i++)
+	{
+		const Kernels &k = list[i].kernels;
+
+		// the premultiply times include copying the pixels back, like those of the old loop
+		printf("%-8s %10.2f %10.2f %10.2f %10.2f %10.2f\n", list[i].name,
+			time_ms([&]() { k.expand(&rgb[0], &buffer[0], count); }),
+			time_ms([&]() { buffer = rgba; k.premultiply(&buffer[0], count); }),
+			time_ms([&]() { k.rotate(&image[0], side * 4, 4, side, side, &buffer[0], side * 4); }),
+			time_ms([&]() { k.rotate(&image[0], side * 3, 3, side, side, &buffer[0], side * 4); }),
+			time_ms([&]() { k.find_first(&empty[0], count); k.find_last(&empty[0], count); }));
+	}
+
+	if (failures > 0)
+	{
+		fprintf(stderr, "%d mismatches\n", failures);
+		return 1;
+	}
+
+	puts("all kernels match the scalar ones");
+	return 0;
+}